@@ -0,0 +1,298 @@
+// Parser micro benchmark. Reads and finalizes generated corpora that stress
+// one part of the reader each, and reports per phase throughput together
+// with hardware counters (cycles, instructions, branch misses, L1D and LLC
+// misses) read through perf_event_open.
+//
+// Counters are Linux only and are often unavailable in containers or with a
+// restrictive perf_event_paranoid; the benchmark then reports timing alone.
+//
+//   bench_dotenv [iterations] [corpus]
+
+#include "node_dotenv.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+using cppnv::EnvPair;
+using cppnv::EnvReader;
+using cppnv::EnvStream;
+
+struct Counter {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+#ifdef __linux__
+constexpr uint64_t CacheConfig(const uint64_t cache, const uint64_t result) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+const Counter kCounters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1d-misses",
+     PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"llc-misses",
+     PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+#else
+const Counter kCounters[] = {
+    {"cycles", 0, 0},
+    {"instructions", 0, 0},
+    {"branch-misses", 0, 0},
+    {"l1d-misses", 0, 0},
+    {"llc-misses", 0, 0},
+};
+#endif
+
+constexpr size_t kCounterCount = sizeof(kCounters) / sizeof(kCounters[0]);
+enum { kCycles, kInstructions, kBranchMisses, kL1dMisses, kLlcMisses };
+
+// One perf event per counter, each opened on its own so a counter the CPU or
+// kernel doesn't offer only drops that column. Counts are scaled by
+// time_enabled / time_running when the kernel had to multiplex them.
+class PerfCounters {
+ public:
+  PerfCounters() {
+    for (size_t i = 0; i < kCounterCount; i++) {
+      fds_[i] = Open(kCounters[i]);
+    }
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (const int fd : fds_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool Available(const size_t counter) const {
+    return fds_[counter] >= 0;
+  }
+
+  bool AnyAvailable() const {
+    for (size_t i = 0; i < kCounterCount; i++) {
+      if (Available(i)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Start() {
+#ifdef __linux__
+    for (const int fd : fds_) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  void Stop(double* values) {
+    for (size_t i = 0; i < kCounterCount; i++) {
+      values[i] = 0;
+#ifdef __linux__
+      if (fds_[i] < 0) {
+        continue;
+      }
+      ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t data[3];
+      if (read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+        continue;
+      }
+      values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+#endif
+    }
+  }
+
+ private:
+  static int Open(const Counter& counter) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter.type;
+    attr.config = counter.config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+    return -1;
+#endif
+  }
+
+  int fds_[kCounterCount];
+};
+
+struct Corpus {
+  const char* name;
+  std::string text;
+};
+
+// Each corpus is about size bytes of one kind of line.
+std::vector<Corpus> MakeCorpora(const size_t size) {
+  std::vector<Corpus> corpora;
+  std::string text;
+
+  for (int i = 0; text.size() < size; i++) {
+    text += "KEY_" + std::to_string(i) + "=value_number_" +
+            std::to_string(i) + "\n";
+  }
+  corpora.push_back({"simple", std::move(text)});
+
+  text.clear();
+  for (int i = 0; text.size() < size; i++) {
+    text += "HEREDOC_" + std::to_string(i) +
+            "=\"\"\"\nfirst line of the heredoc\n"
+            "  second line, with \"quotes\" and 'ticks'\n\"\"\"\n"
+            "LITERAL_" + std::to_string(i) +
+            "='''\nliteral ${not_a_variable}\n'''\n";
+  }
+  corpora.push_back({"heredoc", std::move(text)});
+
+  text.clear();
+  for (int i = 0; text.size() < size; i++) {
+    text += "ESCAPED_" + std::to_string(i) +
+            "=\"tab\\there\\nnew line \\\"quoted\\\" \\\\ slash\\r\\n\"\n";
+  }
+  corpora.push_back({"escape", std::move(text)});
+
+  text.clear();
+  text += "BASE=root\n";
+  for (int i = 0; text.size() < size; i++) {
+    // Chains of eight, so values don't grow without bound.
+    const std::string previous =
+        i % 8 == 0 ? "BASE" : "INTERPOLATED_" + std::to_string(i - 1);
+    text += "INTERPOLATED_" + std::to_string(i) + "=\"${BASE}/" +
+            std::to_string(i) + ":${" + previous + "}\"\n";
+  }
+  corpora.push_back({"interpolation", std::move(text)});
+
+  return corpora;
+}
+
+struct Totals {
+  double nanoseconds = 0;
+  double counters[kCounterCount] = {};
+};
+
+void Report(const char* corpus,
+            const char* phase,
+            const Totals& totals,
+            const double bytes,
+            const PerfCounters& perf) {
+  const double kb = bytes / 1024;
+  printf("%-14s %-9s %9.1f MB/s", corpus, phase,
+         bytes / totals.nanoseconds * 1e9 / (1024 * 1024));
+  if (perf.Available(kCycles)) {
+    printf("  %6.2f cycles/B", totals.counters[kCycles] / bytes);
+  }
+  if (perf.Available(kCycles) && perf.Available(kInstructions) &&
+      totals.counters[kCycles] > 0) {
+    printf("  %5.2f IPC",
+           totals.counters[kInstructions] / totals.counters[kCycles]);
+  }
+  if (perf.Available(kBranchMisses)) {
+    printf("  %7.2f br-miss/KB", totals.counters[kBranchMisses] / kb);
+  }
+  if (perf.Available(kL1dMisses)) {
+    printf("  %7.2f L1D-miss/KB", totals.counters[kL1dMisses] / kb);
+  }
+  if (perf.Available(kLlcMisses)) {
+    printf("  %7.2f LLC-miss/KB", totals.counters[kLlcMisses] / kb);
+  }
+  printf("\n");
+}
+
+void Accumulate(Totals* totals,
+                const std::chrono::steady_clock::time_point start,
+                const double* counters) {
+  totals->nanoseconds += std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+  for (size_t i = 0; i < kCounterCount; i++) {
+    totals->counters[i] += counters[i];
+  }
+}
+
+void Run(const Corpus& corpus, const int iterations, PerfCounters* perf) {
+  Totals read_totals;
+  Totals finalize_totals;
+  double counters[kCounterCount];
+  std::vector<EnvPair*> pairs;
+
+  for (int i = 0; i < iterations; i++) {
+    std::string text = corpus.text;
+    EnvStream stream(&text);
+
+    auto start = std::chrono::steady_clock::now();
+    perf->Start();
+    EnvReader::read_pairs(&stream, &pairs);
+    perf->Stop(counters);
+    Accumulate(&read_totals, start, counters);
+
+    start = std::chrono::steady_clock::now();
+    perf->Start();
+    EnvReader::finalize_pairs(&pairs, nullptr);
+    perf->Stop(counters);
+    Accumulate(&finalize_totals, start, counters);
+
+    EnvReader::delete_pairs(&pairs);
+    pairs.clear();
+  }
+
+  const double bytes = static_cast<double>(corpus.text.size()) * iterations;
+  Report(corpus.name, "read", read_totals, bytes, *perf);
+  Report(corpus.name, "finalize", finalize_totals, bytes, *perf);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 20;
+  const char* only = argc > 2 ? argv[2] : nullptr;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: %s [iterations] [corpus]\n", argv[0]);
+    return 1;
+  }
+
+  PerfCounters perf;
+  if (!perf.AnyAvailable()) {
+    printf("hardware counters unavailable, reporting timing only\n");
+  }
+
+  for (const Corpus& corpus : MakeCorpora(1 << 20)) {
+    if (only == nullptr || strcmp(only, corpus.name) == 0) {
+      Run(corpus, iterations, &perf);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,373 @@
+// Build time .env compiler. Reads .env files the way Dotenv::ParsePath does
+// (interpolations resolve within each file, later files override earlier
+// ones) and writes a header that needs no parsing at runtime: every key and
+// value in one constexpr blob, indexed by a minimal perfect hash, behind a
+// constexpr lookup() that neither allocates nor probes.
+//
+// A circular reference, or a reference to a name its file doesn't define and
+// that has no default, fails the build instead of showing up at startup. The
+// process environment is never consulted, so the output only depends on the
+// input files. The header is left untouched when its content wouldn't
+// change, so it doesn't trigger rebuilds.
+//
+//   dotenv_compiler [--namespace name] output.h input.env...
+
+#include "node_dotenv.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+using cppnv::EnvPair;
+using cppnv::EnvReader;
+using cppnv::EnvStream;
+using cppnv::VariablePosition;
+
+// The generated header carries the same function as text (kHashSource);
+// the two must stay identical.
+uint64_t Hash(const std::string_view key, const uint64_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (const char c : key) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+const char kHashSource[] =
+    "constexpr uint64_t Hash(const std::string_view key, const uint64_t seed) "
+    "{\n"
+    "  uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);"
+    "\n"
+    "  for (const char c : key) {\n"
+    "    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;\n"
+    "  }\n"
+    "  hash ^= hash >> 33;\n"
+    "  hash *= 0xff51afd7ed558ccdULL;\n"
+    "  hash ^= hash >> 33;\n"
+    "  return hash;\n"
+    "}\n";
+
+bool ReadFile(const char* path, std::string* content) {
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  char buffer[8192];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    content->append(buffer, read);
+  }
+  const bool ok = ferror(file) == 0;
+  fclose(file);
+  return ok;
+}
+
+// Reports references that nothing in the file defines and that have no
+// default; finalize_pairs would leave those as written.
+bool CheckReferences(const char* path, const std::vector<EnvPair*>& pairs) {
+  std::unordered_set<std::string_view> keys;
+  for (const EnvPair* pair : pairs) {
+    keys.insert(*pair->key->key);
+  }
+  bool ok = true;
+  for (const EnvPair* pair : pairs) {
+    const std::string_view value = *pair->value->value;
+    for (const VariablePosition& interpolation :
+         pair->value->interpolations) {
+      const int length =
+          interpolation.variable_end - interpolation.variable_start + 1;
+      const std::string_view name =
+          value.substr(interpolation.variable_start, std::max(0, length));
+      if (interpolation.default_start < 0 && keys.count(name) == 0) {
+        fprintf(stderr, "%s: %s references undefined ${%.*s}\n", path,
+                pair->key->key->c_str(), static_cast<int>(name.size()),
+                name.data());
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+bool ParseFile(const char* path, std::map<std::string, std::string>* store) {
+  std::string content;
+  if (!ReadFile(path, &content)) {
+    fprintf(stderr, "%s: can't read file\n", path);
+    return false;
+  }
+  EnvStream stream(&content);
+  std::vector<EnvPair*> pairs;
+  EnvReader::read_pairs(&stream, &pairs);
+  bool ok = CheckReferences(path, pairs);
+
+  std::vector<std::vector<EnvPair*>> cycles;
+  EnvReader::finalize_pairs(&pairs, &cycles);
+  for (const auto& cycle : cycles) {
+    fprintf(stderr, "%s: circular reference between", path);
+    for (const EnvPair* pair : cycle) {
+      fprintf(stderr, " %s", pair->key->key->c_str());
+    }
+    fprintf(stderr, "\n");
+    ok = false;
+  }
+  for (const EnvPair* pair : pairs) {
+    store->insert_or_assign(*pair->key->key, *pair->value->value);
+  }
+  EnvReader::delete_pairs(&pairs);
+  return ok;
+}
+
+// Hash and displace: keys go into one bucket per key by Hash(key, 0), and
+// buckets are placed largest first, each with the first seed that sends
+// all of its keys to free slots. A single key bucket takes any free slot,
+// stored as -slot - 1. There are as many slots as keys.
+bool BuildPerfectHash(const std::vector<std::string_view>& keys,
+                      std::vector<int32_t>* displacements,
+                      std::vector<uint32_t>* slots) {
+  const size_t count = keys.size();
+  std::vector<std::vector<uint32_t>> buckets(count);
+  for (size_t i = 0; i < count; i++) {
+    buckets[Hash(keys[i], 0) % count].push_back(static_cast<uint32_t>(i));
+  }
+  std::vector<uint32_t> order(count);
+  for (size_t i = 0; i < count; i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&buckets](const uint32_t a, const uint32_t b) {
+                     return buckets[a].size() > buckets[b].size();
+                   });
+
+  displacements->assign(count, 0);
+  slots->assign(count, 0);
+  std::vector<bool> taken(count, false);
+  std::vector<uint32_t> placed;
+  size_t free_slot = 0;
+  for (const uint32_t bucket : order) {
+    const std::vector<uint32_t>& members = buckets[bucket];
+    if (members.empty()) {
+      break;
+    }
+    if (members.size() == 1) {
+      while (taken[free_slot]) {
+        free_slot++;
+      }
+      taken[free_slot] = true;
+      (*slots)[members[0]] = static_cast<uint32_t>(free_slot);
+      (*displacements)[bucket] = -static_cast<int32_t>(free_slot) - 1;
+      continue;
+    }
+    for (int32_t seed = 1;; seed++) {
+      if (seed == INT32_MAX) {
+        return false;
+      }
+      placed.clear();
+      for (const uint32_t member : members) {
+        const auto slot = static_cast<uint32_t>(Hash(keys[member], seed) %
+                                                count);
+        if (taken[slot] ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+          break;
+        }
+        placed.push_back(slot);
+      }
+      if (placed.size() < members.size()) {
+        continue;
+      }
+      for (size_t i = 0; i < members.size(); i++) {
+        taken[placed[i]] = true;
+        (*slots)[members[i]] = placed[i];
+      }
+      (*displacements)[bucket] = seed;
+      break;
+    }
+  }
+  return true;
+}
+
+// Octal escapes are always three digits, so a digit that follows one can't
+// be taken as part of it.
+void AppendLiteral(std::string* out, const std::string_view text) {
+  size_t line = 0;
+  *out += "    \"";
+  for (const char c : text) {
+    if (line >= 64) {
+      *out += "\"\n    \"";
+      line = 0;
+    }
+    const auto byte = static_cast<unsigned char>(c);
+    if (byte >= 0x20 && byte < 0x7f && c != '"' && c != '\\' && c != '?') {
+      *out += c;
+      line++;
+    } else {
+      char escaped[5];
+      snprintf(escaped, sizeof(escaped), "\\%03o", byte);
+      *out += escaped;
+      line += 4;
+    }
+  }
+  *out += "\"";
+}
+
+std::string Generate(const std::map<std::string, std::string>& store,
+                     const std::string& name_space,
+                     const std::string& guard,
+                     const std::vector<int32_t>& displacements,
+                     const std::vector<uint32_t>& slots) {
+  struct Entry {
+    size_t key;
+    size_t key_size;
+    size_t value;
+    size_t value_size;
+  };
+  std::string blob;
+  std::vector<Entry> entries(std::max<size_t>(store.size(), 1));
+  size_t index = 0;
+  for (const auto& [key, value] : store) {
+    Entry& entry = entries[slots[index++]];
+    entry = {blob.size(), key.size(), blob.size() + key.size(), value.size()};
+    blob += key;
+    blob += value;
+  }
+
+  std::string out;
+  out += "// Generated by dotenv_compiler. Do not edit.\n\n";
+  out += "#ifndef " + guard + "\n#define " + guard + "\n\n";
+  out += "#include <cstddef>\n#include <cstdint>\n#include <string_view>\n\n";
+  out += "namespace " + name_space + " {\nnamespace detail {\n\n";
+  out += kHashSource;
+  out += "\nstruct Entry {\n  uint32_t key;\n  uint32_t key_size;\n"
+         "  uint32_t value;\n  uint32_t value_size;\n};\n\n";
+  out += "constexpr char kBlob[] =\n";
+  AppendLiteral(&out, blob);
+  out += ";\n\n";
+  out += "constexpr Entry kEntries[] = {\n";
+  for (const Entry& entry : entries) {
+    out += "    {" + std::to_string(entry.key) + ", " +
+           std::to_string(entry.key_size) + ", " + std::to_string(entry.value) +
+           ", " + std::to_string(entry.value_size) + "},\n";
+  }
+  out += "};\n\n";
+  out += "constexpr int32_t kDisplacements[] = {\n";
+  for (size_t i = 0; i < entries.size(); i++) {
+    out += "    " +
+           std::to_string(i < displacements.size() ? displacements[i] : 0) +
+           ",\n";
+  }
+  out += "};\n\n";
+  // A file with no keys still gets one (unused) slot.
+  out += "constexpr size_t kSlots = " + std::to_string(entries.size()) +
+         ";\n\n}  // namespace detail\n\n";
+  out += "constexpr size_t kSize = " + std::to_string(store.size()) + ";\n\n";
+  out += R"(// Finds key with at most two hashes and a single key compare.
+constexpr bool lookup(const std::string_view key, std::string_view* value) {
+  if (kSize == 0) {
+    return false;
+  }
+  const int32_t displacement =
+      detail::kDisplacements[detail::Hash(key, 0) % detail::kSlots];
+  const size_t slot =
+      displacement < 0
+          ? static_cast<size_t>(-static_cast<int64_t>(displacement) - 1)
+          : static_cast<size_t>(detail::Hash(key, displacement) %
+                                detail::kSlots);
+  const detail::Entry& entry = detail::kEntries[slot];
+  if (std::string_view(detail::kBlob + entry.key, entry.key_size) != key) {
+    return false;
+  }
+  *value = std::string_view(detail::kBlob + entry.value, entry.value_size);
+  return true;
+}
+
+// Returns the value of key, or an empty view if it isn't defined.
+constexpr std::string_view lookup(const std::string_view key) {
+  std::string_view value;
+  lookup(key, &value);
+  return value;
+}
+
+)";
+  out += "}  // namespace " + name_space + "\n\n#endif  // " + guard + "\n";
+  return out;
+}
+
+std::string GuardFor(const char* path) {
+  const char* name = strrchr(path, '/');
+  name = name == nullptr ? path : name + 1;
+  std::string guard;
+  for (const char* c = name; *c != '\0'; c++) {
+    const auto byte = static_cast<unsigned char>(*c);
+    guard += isalnum(byte) ? static_cast<char>(toupper(byte)) : '_';
+  }
+  return guard + "_";
+}
+
+bool WriteIfChanged(const char* path, const std::string& content) {
+  std::string existing;
+  if (ReadFile(path, &existing) && existing == content) {
+    return true;
+  }
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  const bool ok =
+      fwrite(content.data(), 1, content.size(), file) == content.size();
+  return fclose(file) == 0 && ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string name_space = "dotenv";
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "--namespace") == 0) {
+    name_space = argv[arg + 1];
+    arg += 2;
+  }
+  if (argc - arg < 2) {
+    fprintf(stderr, "usage: %s [--namespace name] output.h input.env...\n",
+            argv[0]);
+    return 1;
+  }
+  const char* output = argv[arg++];
+
+  std::map<std::string, std::string> store;
+  bool ok = true;
+  for (; arg < argc; arg++) {
+    ok = ParseFile(argv[arg], &store) && ok;
+  }
+  if (!ok) {
+    return 1;
+  }
+
+  std::vector<std::string_view> keys;
+  keys.reserve(store.size());
+  for (const auto& entry : store) {
+    keys.emplace_back(entry.first);
+  }
+  std::vector<int32_t> displacements;
+  std::vector<uint32_t> slots;
+  if (!BuildPerfectHash(keys, &displacements, &slots)) {
+    fprintf(stderr, "%s: no perfect hash found\n", output);
+    return 1;
+  }
+  if (!WriteIfChanged(output, Generate(store, name_space, GuardFor(output),
+                                       displacements, slots))) {
+    fprintf(stderr, "%s: can't write file\n", output);
+    return 1;
+  }
+  return 0;
+}
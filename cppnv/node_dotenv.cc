@@ -3,6 +3,84 @@
 #include "node_file.h"
 #include "uv.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// USDT probes: each is a single nop until a tracer attaches to it.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CPPNV_HAS_SDT 1
+#endif
+#endif
+
+#ifdef CPPNV_HAS_SDT
+#define CPPNV_PROBE1(name, a) DTRACE_PROBE1(cppnv, name, a)
+#define CPPNV_PROBE2(name, a, b) DTRACE_PROBE2(cppnv, name, a, b)
+#define CPPNV_PROBE3(name, a, b, c) DTRACE_PROBE3(cppnv, name, a, b, c)
+#else
+#define CPPNV_PROBE1(name, a) do {} while (0)
+#define CPPNV_PROBE2(name, a, b) do {} while (0)
+#define CPPNV_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace cppnv {
+namespace {
+uint64_t MicrosecondsNow() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records the enclosing scope as a trace event while TraceEventWriter is
+// recording.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+    : name_(name),
+      start_(TraceEventWriter::IsRecording() ? MicrosecondsNow() : 0) {
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  void set_detail(const char* name, const uint64_t detail) {
+    detail_name_ = name;
+    detail_ = detail;
+  }
+
+  ~TraceSpan() {
+    if (start_ != 0 && TraceEventWriter::IsRecording()) {
+      TraceEventWriter::Record(name_, start_, MicrosecondsNow() - start_,
+                               detail_name_, detail_);
+    }
+  }
+
+ private:
+  const char* name_;
+  uint64_t start_;
+  const char* detail_name_ = nullptr;
+  uint64_t detail_ = 0;
+};
+}  // namespace
+}  // namespace cppnv
+
 namespace node {
 using cppnv::EnvKey;
 using cppnv::EnvPair;
@@ -11,6 +89,99 @@ using cppnv::EnvStream;
 using v8::NewStringType;
 using v8::String;
 
+#ifndef _WIN32
+namespace {
+// Lays out a NULL terminated environ array followed by the KEY=value strings
+// it points to in one malloc()ed block. Entries of base are kept in order,
+// entries of the store either replace the base entry with the same key (when
+// override is set) or are appended. base is hashed once, so the whole merge
+// is linear in the size of both.
+char** BuildEnvironmentBlock(const char* const* base,
+                             const std::map<std::string, std::string>& store,
+                             const bool override) {
+  std::vector<std::string_view> base_entries;
+  std::unordered_map<std::string_view, size_t> base_index;
+  for (size_t i = 0; base != nullptr && base[i] != nullptr; i++) {
+    const std::string_view entry(base[i]);
+    base_index.emplace(entry.substr(0, entry.find('=')), i);
+    base_entries.push_back(entry);
+  }
+
+  // For every base slot, the store entry that replaces it (if any).
+  std::vector<const std::pair<const std::string, std::string>*> replaced(
+      base_entries.size(), nullptr);
+  std::vector<const std::pair<const std::string, std::string>*> appended;
+  size_t strings_size = 0;
+  for (const auto& entry : store) {
+    const auto match = base_index.find(entry.first);
+    if (match == base_index.end()) {
+      appended.push_back(&entry);
+    } else if (override) {
+      replaced[match->second] = &entry;
+    } else {
+      continue;
+    }
+    strings_size += entry.first.size() + entry.second.size() + 2;
+  }
+  for (size_t i = 0; i < base_entries.size(); i++) {
+    if (replaced[i] == nullptr) {
+      strings_size += base_entries[i].size() + 1;
+    }
+  }
+
+  const size_t count = base_entries.size() + appended.size();
+  const size_t array_size = (count + 1) * sizeof(char*);
+  auto block = static_cast<char**>(malloc(array_size + strings_size));
+  if (block == nullptr) {
+    return nullptr;
+  }
+
+  char* cursor = reinterpret_cast<char*>(block) + array_size;
+  const auto write_entry = [&cursor](std::string_view key,
+                                     std::string_view value) {
+    char* start = cursor;
+    memcpy(cursor, key.data(), key.size());
+    cursor += key.size();
+    *cursor++ = '=';
+    memcpy(cursor, value.data(), value.size());
+    cursor += value.size();
+    *cursor++ = '\0';
+    return start;
+  };
+  size_t slot = 0;
+  for (size_t i = 0; i < base_entries.size(); i++) {
+    if (replaced[i] != nullptr) {
+      block[slot++] = write_entry(replaced[i]->first, replaced[i]->second);
+      continue;
+    }
+    block[slot] = cursor;
+    memcpy(cursor, base_entries[i].data(), base_entries[i].size());
+    cursor += base_entries[i].size();
+    *cursor++ = '\0';
+    slot++;
+  }
+  for (const auto entry : appended) {
+    block[slot++] = write_entry(entry->first, entry->second);
+  }
+  block[slot] = nullptr;
+  return block;
+}
+
+// Whether base holds exactly the entry pointers in entries, so a block built
+// from it still reflects it after setenv(), putenv() or unsetenv().
+bool SameEntries(const char* const* base,
+                 const std::vector<const char*>& entries) {
+  size_t i = 0;
+  for (; base != nullptr && base[i] != nullptr; i++) {
+    if (i == entries.size() || base[i] != entries[i]) {
+      return false;
+    }
+  }
+  return i == entries.size();
+}
+}  // namespace
+#endif
+
 std::vector<std::string> Dotenv::GetPathFromArgs(
     const std::vector<std::string>& args) {
   const auto find_match = [](const std::string& arg) {
@@ -67,24 +238,379 @@ void Dotenv::SetEnvironment(node::Environment* env) {
   }
 }
 
-bool Dotenv::ParsePath(const std::string_view path) {
-  uv_fs_t req;
-  auto defer_req_cleanup = OnScopeLeave([&req]() { uv_fs_req_cleanup(&req); });
+#ifndef _WIN32
+bool Dotenv::SetProcessEnvironment(const bool override) {
+  if (store_.empty()) {
+    return true;
+  }
 
-  uv_file file = uv_fs_open(nullptr, &req, path.data(), 0, 438, nullptr);
-  if (req.result < 0) {
-    // req will be cleaned up by scope leave.
+  char** block = BuildEnvironmentBlock(environ, store_, override);
+  if (block == nullptr) {
+    return false;
+  }
+  // The previous environ is intentionally not freed: it is either owned by
+  // libc or a block from an earlier call, and pointers returned by getenv()
+  // may still point into it.
+  environ = block;
+  return true;
+}
+
+char* const* Dotenv::GetEnvp(char* const* base) {
+  if (envp_ != nullptr && envp_base_ == base &&
+      SameEntries(base, envp_base_entries_)) {
+    return envp_.get();
+  }
+
+  char** block = BuildEnvironmentBlock(base, store_, true);
+  if (block == nullptr) {
+    return nullptr;
+  }
+  envp_.reset(block, free);
+  envp_base_ = base;
+  envp_base_entries_.clear();
+  for (size_t i = 0; base != nullptr && base[i] != nullptr; i++) {
+    envp_base_entries_.push_back(base[i]);
+  }
+  return envp_.get();
+}
+
+bool Dotenv::PublishSnapshot(const std::string& name,
+                             const mode_t mode) const {
+  return SharedEnvImage::Publish(name, store_, mode);
+}
+
+namespace {
+constexpr uint32_t kImageMagic = 0x31766e65;  // "env1"
+
+// Offsets are from the start of the image. Entries follow the header,
+// then the bucket array (entry index + 1, 0 when empty), then the strings,
+// each NUL terminated.
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t bucket_count;
+  uint32_t strings_offset;
+  uint64_t generation;
+  uint64_t size;
+};
+
+struct ImageEntry {
+  uint64_t hash;
+  uint32_t key_offset;
+  uint32_t key_length;
+  uint32_t value_offset;
+  uint32_t value_length;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the generation counter is shared between processes");
+
+// FNV-1a, so every process agrees on the hash.
+uint64_t HashKey(const std::string_view key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char c : key) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::string GenerationName(const std::string& name, const uint64_t generation) {
+  return name + "." + std::to_string(generation);
+}
+
+// The control segment is two counters: [0] is the published generation
+// readers open, [1] the last generation a publisher claimed.
+constexpr size_t kControlSize = 2 * sizeof(std::atomic<uint64_t>);
+
+// mode only matters when create makes the segment.
+std::atomic<uint64_t>* MapControl(const std::string& name,
+                                  const bool create,
+                                  const mode_t mode) {
+  // Readers only ever load the counter.
+  const int fd = shm_open(name.c_str(), create ? O_RDWR | O_CREAT : O_RDONLY,
+                          mode);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // A new segment is zero filled, which reads as generation 0: nothing
+  // published yet.
+  if (create && ftruncate(fd, kControlSize) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  void* memory = mmap(nullptr, kControlSize,
+                      create ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+  return static_cast<std::atomic<uint64_t>*>(memory);
+}
+
+void UnmapControl(std::atomic<uint64_t>* control) {
+  munmap(control, kControlSize);
+}
+}  // namespace
+
+bool SharedEnvImage::Publish(
+    const std::string& name,
+    const std::map<std::string, std::string>& entries,
+    const mode_t mode) {
+  uint32_t bucket_count = 1;
+  while (bucket_count < entries.size() * 2) {
+    bucket_count *= 2;
+  }
+  const size_t strings_offset = sizeof(ImageHeader) +
+                                entries.size() * sizeof(ImageEntry) +
+                                bucket_count * sizeof(uint32_t);
+  size_t size = strings_offset;
+  for (const auto& [key, value] : entries) {
+    size += key.size() + value.size() + 2;
+  }
+  if (size > UINT32_MAX) {
     return false;
   }
+
+  std::atomic<uint64_t>* control = MapControl(name, true, mode);
+  if (control == nullptr) {
+    return false;
+  }
+  // Every publisher claims a generation of its own, so two never write the
+  // same segment and none has to guess whether another is still alive. A
+  // name that already exists (left by a publisher that died, say) is never
+  // removed, only skipped.
+  std::atomic<uint64_t>& published = control[0];
+  std::atomic<uint64_t>& claimed = control[1];
+  uint64_t generation = 0;
+  std::string segment;
+  int fd = -1;
+  for (int attempt = 0; fd < 0 && attempt < 4; attempt++) {
+    uint64_t last = claimed.load(std::memory_order_acquire);
+    do {
+      generation =
+          std::max(last, published.load(std::memory_order_acquire)) + 1;
+    } while (!claimed.compare_exchange_weak(last, generation,
+                                            std::memory_order_acq_rel));
+    segment = GenerationName(name, generation);
+    fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fd < 0 && errno != EEXIST) {
+      break;
+    }
+  }
+  if (fd < 0) {
+    UnmapControl(control);
+    return false;
+  }
+  void* memory = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(segment.c_str());
+    UnmapControl(control);
+    return false;
+  }
+
+  char* image = static_cast<char*>(memory);
+  auto* header = reinterpret_cast<ImageHeader*>(image);
+  auto* image_entries = reinterpret_cast<ImageEntry*>(header + 1);
+  auto* buckets = reinterpret_cast<uint32_t*>(image_entries + entries.size());
+  header->magic = kImageMagic;
+  header->count = static_cast<uint32_t>(entries.size());
+  header->bucket_count = bucket_count;
+  header->strings_offset = static_cast<uint32_t>(strings_offset);
+  header->generation = generation;
+  header->size = size;
+  memset(buckets, 0, bucket_count * sizeof(uint32_t));
+
+  uint32_t index = 0;
+  size_t offset = strings_offset;
+  for (const auto& [key, value] : entries) {
+    ImageEntry& entry = image_entries[index];
+    entry.hash = HashKey(key);
+    entry.key_offset = static_cast<uint32_t>(offset);
+    entry.key_length = static_cast<uint32_t>(key.size());
+    memcpy(image + offset, key.c_str(), key.size() + 1);
+    offset += key.size() + 1;
+    entry.value_offset = static_cast<uint32_t>(offset);
+    entry.value_length = static_cast<uint32_t>(value.size());
+    memcpy(image + offset, value.c_str(), value.size() + 1);
+    offset += value.size() + 1;
+
+    uint32_t bucket = entry.hash & (bucket_count - 1);
+    while (buckets[bucket] != 0) {
+      bucket = (bucket + 1) & (bucket_count - 1);
+    }
+    buckets[bucket] = ++index;
+  }
+  munmap(memory, size);
+
+  // A publisher that claimed a later generation may have finished first.
+  // The counter only moves forward, and an image it already passed is
+  // dropped as if it had been replaced right away.
+  uint64_t previous = published.load(std::memory_order_acquire);
+  while (previous < generation &&
+         !published.compare_exchange_weak(previous, generation,
+                                          std::memory_order_acq_rel)) {
+  }
+  UnmapControl(control);
+  if (previous > generation) {
+    shm_unlink(segment.c_str());
+  } else if (previous != 0) {
+    // Processes that mapped the previous generation keep their mapping.
+    shm_unlink(GenerationName(name, previous).c_str());
+  }
+  return true;
+}
+
+std::unique_ptr<SharedEnvImage> SharedEnvImage::Open(const std::string& name) {
+  std::atomic<uint64_t>* control = MapControl(name, false, 0);
+  if (control == nullptr) {
+    return nullptr;
+  }
+  // The generation read can be unlinked by a newer Publish before it is
+  // opened; the counter has moved on by then, so read it again.
+  for (int attempt = 0; attempt < 8; attempt++) {
+    const uint64_t generation = control->load(std::memory_order_acquire);
+    if (generation == 0) {
+      break;
+    }
+    const int fd = shm_open(GenerationName(name, generation).c_str(),
+                            O_RDONLY, 0);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat stat_buffer;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &stat_buffer) == 0 &&
+        static_cast<size_t>(stat_buffer.st_size) >= sizeof(ImageHeader)) {
+      memory = mmap(nullptr, stat_buffer.st_size, PROT_READ, MAP_SHARED, fd,
+                    0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+      break;
+    }
+    const auto* header = static_cast<const ImageHeader*>(memory);
+    if (header->magic != kImageMagic ||
+        header->size != static_cast<uint64_t>(stat_buffer.st_size)) {
+      munmap(memory, stat_buffer.st_size);
+      break;
+    }
+    std::unique_ptr<SharedEnvImage> image(new SharedEnvImage());
+    image->image_ = static_cast<const char*>(memory);
+    image->image_size_ = stat_buffer.st_size;
+    image->control_ = control;
+    return image;
+  }
+  UnmapControl(control);
+  return nullptr;
+}
+
+void SharedEnvImage::Unlink(const std::string& name) {
+  if (std::atomic<uint64_t>* control = MapControl(name, false, 0)) {
+    const uint64_t generation = control->load(std::memory_order_acquire);
+    UnmapControl(control);
+    if (generation != 0) {
+      shm_unlink(GenerationName(name, generation).c_str());
+    }
+  }
+  shm_unlink(name.c_str());
+}
+
+SharedEnvImage::~SharedEnvImage() {
+  munmap(const_cast<char*>(image_), image_size_);
+  UnmapControl(control_);
+}
+
+bool SharedEnvImage::Get(const std::string_view key,
+                         std::string_view* value) const {
+  const auto* header = reinterpret_cast<const ImageHeader*>(image_);
+  const auto* entries = reinterpret_cast<const ImageEntry*>(header + 1);
+  const auto* buckets =
+      reinterpret_cast<const uint32_t*>(entries + header->count);
+  const uint64_t hash = HashKey(key);
+  for (uint32_t bucket = hash & (header->bucket_count - 1);
+       buckets[bucket] != 0;
+       bucket = (bucket + 1) & (header->bucket_count - 1)) {
+    const ImageEntry& entry = entries[buckets[bucket] - 1];
+    if (entry.hash == hash && entry.key_length == key.size() &&
+        memcmp(image_ + entry.key_offset, key.data(), key.size()) == 0) {
+      *value = std::string_view(image_ + entry.value_offset,
+                                entry.value_length);
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t SharedEnvImage::Size() const {
+  return reinterpret_cast<const ImageHeader*>(image_)->count;
+}
+
+uint64_t SharedEnvImage::Generation() const {
+  return reinterpret_cast<const ImageHeader*>(image_)->generation;
+}
+
+bool SharedEnvImage::IsStale() const {
+  return control_->load(std::memory_order_acquire) != Generation();
+}
+#endif
+
+Dotenv::Dotenv(const Dotenv& d) : store_(d.store_) {
+}
+
+Dotenv& Dotenv::operator=(const Dotenv& d) {
+  if (this != &d) {
+    store_ = d.store_;
+    InvalidateCaches();
+  }
+  return *this;
+}
+
+const cppnv::EnvPrefixIndex& Dotenv::GetPrefixIndex() {
+  if (prefix_index_ == nullptr) {
+    prefix_index_ = std::make_shared<cppnv::EnvPrefixIndex>(store_);
+  }
+  return *prefix_index_;
+}
+
+void Dotenv::InvalidateCaches() {
+  typed_values_.clear();
+  typed_generation_.Advance();
+  prefix_index_.reset();
+#ifndef _WIN32
+  envp_.reset();
+  envp_base_ = nullptr;
+  envp_base_entries_.clear();
+#endif
+}
+
+namespace {
+using ParsedEntries = std::vector<std::pair<std::string, std::string>>;
+
+// Opens path for reading, or returns -1.
+uv_file OpenFile(const std::string& path) {
+  uv_fs_t req;
+  const uv_file file =
+      uv_fs_open(nullptr, &req, path.c_str(), 0, 438, nullptr);
+  const bool opened = req.result >= 0;
   uv_fs_req_cleanup(&req);
+  return opened ? file : -1;
+}
+
+void CloseFile(const uv_file file) {
+  uv_fs_t close_req;
+  CHECK_EQ(0, uv_fs_close(nullptr, &close_req, file, nullptr));
+  uv_fs_req_cleanup(&close_req);
+}
 
-  auto defer_close = OnScopeLeave([file]() {
-    uv_fs_t close_req;
-    CHECK_EQ(0, uv_fs_close(nullptr, &close_req, file, nullptr));
-    uv_fs_req_cleanup(&close_req);
-  });
+bool ReadOpenFile(const uv_file file, std::string* content) {
+  uv_fs_t req;
+  auto defer_req_cleanup = OnScopeLeave([&req]() { uv_fs_req_cleanup(&req); });
 
-  std::string result{};
   char buffer[8192];
   uv_buf_t buf = uv_buf_init(buffer, sizeof(buffer));
 
@@ -98,227 +624,2133 @@ bool Dotenv::ParsePath(const std::string_view path) {
     if (r <= 0) {
       break;
     }
-    result.append(buf.base, r);
+    content->append(buf.base, r);
+  }
+  return true;
+}
+
+bool ReadFile(const std::string& path, std::string* content) {
+  const uv_file file = OpenFile(path);
+  if (file < 0) {
+    return false;
   }
+  auto defer_close = OnScopeLeave([file]() { CloseFile(file); });
+  return ReadOpenFile(file, content);
+}
 
-  EnvStream env_stream(&result);
+void ParseEntries(std::string* content, ParsedEntries* entries) {
+  EnvStream env_stream(content);
 
   std::vector<EnvPair*> env_pairs;
   EnvReader::read_pairs(&env_stream, &env_pairs);
 
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  entries->reserve(env_pairs.size());
   for (const auto pair : env_pairs) {
-    EnvReader::finalize_value(pair, &env_pairs);
-    store_.insert_or_assign(*pair->key->key, *pair->value->value);
+    entries->emplace_back(*pair->key->key, *pair->value->value);
   }
   EnvReader::delete_pairs(&env_pairs);
-  return true;
 }
 
-void Dotenv::AssignNodeOptionsIfAvailable(std::string* node_options) {
-  auto match = store_.find("NODE_OPTIONS");
-
-  if (match != store_.end()) {
-    *node_options = match->second;
+// Hashes a word at a time; only used to recognize content parsed before.
+uint64_t HashContent(const std::string_view content) {
+  constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = content.size() * kMultiplier;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= content.size(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, content.data() + i, sizeof(word));
+    hash = (hash ^ word) * kMultiplier;
+    hash ^= hash >> 32;
   }
+  uint64_t tail = 0;
+  memcpy(&tail, content.data() + i, content.size() - i);
+  hash = (hash ^ tail) * kMultiplier;
+  return hash ^ (hash >> 29);
 }
 
-void Dotenv::ParseLine(const std::string_view line) {
-  auto equal_index = line.find('=');
+struct FileIdentity {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t modified_seconds;
+  int64_t modified_nanoseconds;
 
-  if (equal_index == std::string_view::npos) {
-    return;
+  bool operator==(const FileIdentity& other) const {
+    return device == other.device && inode == other.inode &&
+           size == other.size && modified_seconds == other.modified_seconds &&
+           modified_nanoseconds == other.modified_nanoseconds;
   }
+};
 
-  auto key = line.substr(0, equal_index);
-
-  // Remove leading and trailing space characters from key.
-  while (!key.empty() && std::isspace(key.front())) key.remove_prefix(1);
-  while (!key.empty() && std::isspace(key.back())) key.remove_suffix(1);
-
-  // Omit lines with comments
-  if (key.front() == '#' || key.empty()) {
-    return;
+bool StatFile(const uv_file file, FileIdentity* identity) {
+  uv_fs_t req;
+  uv_fs_fstat(nullptr, &req, file, nullptr);
+  if (req.result < 0) {
+    uv_fs_req_cleanup(&req);
+    return false;
   }
+  *identity = {req.statbuf.st_dev,
+               req.statbuf.st_ino,
+               req.statbuf.st_size,
+               static_cast<int64_t>(req.statbuf.st_mtim.tv_sec),
+               static_cast<int64_t>(req.statbuf.st_mtim.tv_nsec)};
+  uv_fs_req_cleanup(&req);
+  return true;
+}
 
-  auto value = std::string(line.substr(equal_index + 1));
-
-  // Might start and end with `"' characters.
-  auto quotation_index = value.find_first_of("`\"'");
+struct FileIdentityHash {
+  size_t operator()(const FileIdentity& identity) const {
+    uint64_t hash = identity.inode;
+    hash = hash * 31 + identity.device;
+    hash = hash * 31 + identity.size;
+    hash = hash * 31 + identity.modified_seconds;
+    hash = hash * 31 + identity.modified_nanoseconds;
+    return hash;
+  }
+};
 
-  if (quotation_index == 0) {
-    auto quote_character = value[quotation_index];
-    value.erase(0, 1);
+class ParseCache {
+ public:
+  // Never destroyed, so ParsePath stays usable during static destruction.
+  static ParseCache* Get() {
+    static ParseCache* cache = new ParseCache();
+    return cache;
+  }
 
-    auto end_quotation_index = value.find_last_of(quote_character);
+  std::shared_ptr<const ParsedEntries> Find(const FileIdentity& identity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto match = by_identity_.find(identity);
+    return match == by_identity_.end() ? nullptr : match->second;
+  }
 
-    // We couldn't find the closing quotation character. Terminate.
-    if (end_quotation_index == std::string::npos) {
-      return;
+  // The hash only narrows the search; entries are reused only when the
+  // content they were parsed from is the same, byte for byte.
+  std::shared_ptr<const ParsedEntries> FindContent(
+      const uint64_t hash,
+      const std::string_view content) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto match = by_content_.find(hash);
+    if (match == by_content_.end() || *match->second.content != content) {
+      return nullptr;
     }
+    return match->second.entries;
+  }
 
-    value.erase(end_quotation_index);
-  } else {
-    auto hash_index = value.find('#');
-
-    // Remove any inline comments
-    if (hash_index != std::string::npos) {
-      value.erase(hash_index);
+  void Insert(const FileIdentity& identity,
+              const uint64_t hash,
+              std::string content,
+              const std::shared_ptr<const ParsedEntries>& entries) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Files that keep changing leave stale identities behind; start over
+    // rather than grow without bound.
+    if (by_identity_.size() >= kMaxFiles) {
+      by_identity_.clear();
+      by_content_.clear();
     }
+    by_identity_.insert_or_assign(identity, entries);
+    by_content_.insert_or_assign(
+        hash,
+        ContentEntry{std::make_shared<const std::string>(std::move(content)),
+                     entries});
+  }
 
-    // Remove any leading/trailing spaces from unquoted values.
-    while (!value.empty() && std::isspace(value.front())) value.erase(0, 1);
-    while (!value.empty() && std::isspace(value.back()))
-      value.erase(value.size() - 1);
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    by_identity_.clear();
+    by_content_.clear();
   }
 
-  store_.insert_or_assign(std::string(key), value);
-}
+ private:
+  static constexpr size_t kMaxFiles = 1024;
 
-}  // namespace node
+  struct ContentEntry {
+    std::shared_ptr<const std::string> content;
+    std::shared_ptr<const ParsedEntries> entries;
+  };
 
+  std::mutex mutex_;
+  std::unordered_map<FileIdentity,
+                     std::shared_ptr<const ParsedEntries>,
+                     FileIdentityHash> by_identity_;
+  std::unordered_map<uint64_t, ContentEntry> by_content_;
+};
 
-namespace cppnv {
-VariablePosition::VariablePosition(const int variable_start,
-                                   const int start_brace,
-                                   const int dollar_sign)
-  : variable_start(
-        variable_start),
-    start_brace(start_brace),
-    dollar_sign(dollar_sign),
-    end_brace(0),
-    variable_end(0) {
-  variable_str = new std::string();
-}
-cppnv::EnvStream::EnvStream(std::string* data) {
-  this->data_ = data;
-  this->length_ = this->data_->length();
-  this->is_good_ = this->index_ < this->length_;
+std::atomic<bool> parse_cache_enabled{false};
+
+// Reads and parses path, through the parse cache when it is enabled. Returns
+// nullptr if path can't be read. bytes is what was read, zero on a cache hit.
+std::shared_ptr<const ParsedEntries> LoadEntries(const std::string& path,
+                                                 size_t* bytes) {
+  *bytes = 0;
+  if (!parse_cache_enabled.load(std::memory_order_relaxed)) {
+    std::string content;
+    if (!ReadFile(path, &content)) {
+      return nullptr;
+    }
+    *bytes = content.size();
+    auto entries = std::make_shared<ParsedEntries>();
+    ParseEntries(&content, entries.get());
+    return entries;
+  }
+
+  // The identity comes from the descriptor that is read, so a rename in
+  // between can't pair one file's identity with another's content.
+  const uv_file file = OpenFile(path);
+  if (file < 0) {
+    return nullptr;
+  }
+  auto defer_close = OnScopeLeave([file]() { CloseFile(file); });
+  FileIdentity identity;
+  if (!StatFile(file, &identity)) {
+    return nullptr;
+  }
+
+  ParseCache* cache = ParseCache::Get();
+  std::shared_ptr<const ParsedEntries> entries = cache->Find(identity);
+  if (entries != nullptr) {
+    return entries;
+  }
+  std::string content;
+  if (!ReadOpenFile(file, &content)) {
+    return nullptr;
+  }
+  *bytes = content.size();
+  const uint64_t hash = HashContent(content);
+  entries = cache->FindContent(hash, content);
+  if (entries == nullptr) {
+    auto parsed = std::make_shared<ParsedEntries>();
+    ParseEntries(&content, parsed.get());
+    entries = std::move(parsed);
+  }
+  // A write while reading changes the identity; what was read then matches
+  // neither the old nor the new one, so it isn't cached.
+  FileIdentity after;
+  if (StatFile(file, &after) && after == identity) {
+    cache->Insert(identity, hash, std::move(content), entries);
+  }
+  return entries;
 }
+}  // namespace
 
-char cppnv::EnvStream::get() {
-  if (this->index_ >= this->length_) {
-    return -1;
+void Dotenv::SetParseCacheEnabled(const bool enabled) {
+  parse_cache_enabled.store(enabled, std::memory_order_relaxed);
+  if (!enabled) {
+    ParseCache::Get()->Clear();
   }
-  const auto ret = this->data_->at(this->index_);
-  this->index_++;
-  this->is_good_ = this->index_ < this->length_;
-  return ret;
 }
 
-bool cppnv::EnvStream::good() const {
-  return this->is_good_;
+void Dotenv::ClearParseCache() {
+  ParseCache::Get()->Clear();
 }
 
-bool cppnv::EnvStream::eof() const {
-  return !good();
+bool Dotenv::ParsePath(const std::string_view path) {
+  // The probes and libuv take a C string, which a string_view isn't.
+  const std::string file(path);
+  CPPNV_PROBE1(parse_path__start, file.c_str());
+  cppnv::TraceSpan span("ParsePath");
+  size_t bytes;
+  const auto entries = LoadEntries(file, &bytes);
+  if (entries == nullptr) {
+    CPPNV_PROBE1(parse_path__error, file.c_str());
+    return false;
+  }
+  StoreEntries(*entries);
+  CPPNV_PROBE3(parse_path__done, file.c_str(), bytes, entries->size());
+  span.set_detail("bytes", bytes);
+  return true;
 }
-EnvReader::read_result EnvReader::read_pair(EnvStream* file,
-                                            const EnvPair* pair) {
+
+bool Dotenv::ParseProfile(const std::string_view path,
+                          const std::string_view profile) {
+  cppnv::TraceSpan span("ParseProfile");
+  std::string content;
+  if (!ReadFile(std::string(path), &content)) {
+    return false;
+  }
+  const cppnv::EnvSectionIndex index(content);
+  std::vector<EnvPair*> env_pairs;
+  if (!EnvReader::read_profile(&content, index, profile, &env_pairs)) {
+    return false;
+  }
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  ParsedEntries entries;
+  entries.reserve(env_pairs.size());
+  for (const auto pair : env_pairs) {
+    entries.emplace_back(*pair->key->key, *pair->value->value);
+  }
+  EnvReader::delete_pairs(&env_pairs);
+  StoreEntries(entries);
+  span.set_detail("pairs", entries.size());
+  return true;
+}
+
+namespace {
+// The fragment indices [begin, end) a directory worker has left to parse.
+// The owner takes from the front and idle workers steal the back half. Both
+// ends share one word, so either side is a single compare-and-swap, and as
+// an index is only ever handed out once a range can't reappear (no ABA).
+class alignas(64) WorkRange {
+ public:
+  void Assign(const uint32_t begin, const uint32_t end) {
+    range_.store(Pack(begin, end), std::memory_order_release);
+  }
+
+  bool Take(uint32_t* index) {
+    uint64_t range = range_.load(std::memory_order_acquire);
+    while (Begin(range) < End(range)) {
+      if (range_.compare_exchange_weak(range,
+                                       Pack(Begin(range) + 1, End(range)),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        *index = Begin(range);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Steal(uint32_t* begin, uint32_t* end) {
+    uint64_t range = range_.load(std::memory_order_acquire);
+    while (Begin(range) < End(range)) {
+      const uint32_t middle =
+          Begin(range) + (End(range) - Begin(range)) / 2;
+      if (range_.compare_exchange_weak(range,
+                                       Pack(Begin(range), middle),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        *begin = middle;
+        *end = End(range);
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static uint64_t Pack(const uint32_t begin, const uint32_t end) {
+    return static_cast<uint64_t>(begin) << 32 | end;
+  }
+  static uint32_t Begin(const uint64_t range) {
+    return static_cast<uint32_t>(range >> 32);
+  }
+  static uint32_t End(const uint64_t range) {
+    return static_cast<uint32_t>(range);
+  }
+
+  std::atomic<uint64_t> range_{0};
+};
+
+// Runs as worker self until no range has work left. Once every range was
+// seen empty, any index still unparsed belongs to a worker parsing it.
+void ParseFragments(const std::vector<std::string>* paths,
+                    WorkRange* ranges,
+                    const size_t workers,
+                    const size_t self,
+                    std::vector<std::shared_ptr<const ParsedEntries>>* parsed) {
+  while (true) {
+    uint32_t index;
+    while (ranges[self].Take(&index)) {
+      const std::string& path = (*paths)[index];
+      CPPNV_PROBE1(parse_file__start, path.c_str());
+      cppnv::TraceSpan span("ParseFile");
+      size_t bytes;
+      const auto entries = LoadEntries(path, &bytes);
+      (*parsed)[index] = entries;
+      if (entries == nullptr) {
+        CPPNV_PROBE1(parse_file__error, path.c_str());
+        continue;
+      }
+      CPPNV_PROBE3(parse_file__done, path.c_str(), bytes, entries->size());
+      span.set_detail("bytes", bytes);
+    }
+    uint32_t begin;
+    uint32_t end;
+    bool stolen = false;
+    for (size_t i = 1; i < workers && !stolen; i++) {
+      stolen = ranges[(self + i) % workers].Steal(&begin, &end);
+    }
+    if (!stolen) {
+      return;
+    }
+    ranges[self].Assign(begin, end);
+  }
+}
+
+// Whether a scanned entry is a regular file, following symlinks. Entries
+// the scan couldn't type, and links, are stat()ed to find out.
+bool IsRegularFile(const uv_dirent_t& entry, const std::string& path) {
+  if (entry.type == UV_DIRENT_FILE) {
+    return true;
+  }
+  if (entry.type != UV_DIRENT_UNKNOWN && entry.type != UV_DIRENT_LINK) {
+    return false;
+  }
+  uv_fs_t req;
+  const bool regular =
+      uv_fs_stat(nullptr, &req, path.c_str(), nullptr) == 0 &&
+      (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  uv_fs_req_cleanup(&req);
+  return regular;
+}
+}  // namespace
+
+bool Dotenv::ParseDirectory(const std::string_view directory,
+                            const std::string_view suffix,
+                            size_t threads) {
+  cppnv::TraceSpan span("ParseDirectory");
+  std::string prefix(directory);
+  uv_fs_t req;
+  uv_fs_scandir(nullptr, &req, prefix.c_str(), 0, nullptr);
+  if (req.result < 0) {
+    uv_fs_req_cleanup(&req);
+    return false;
+  }
+  if (!prefix.empty() && prefix.back() != '/') {
+    prefix += '/';
+  }
+
+  std::vector<std::string> paths;
+  uv_dirent_t entry;
+  while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+    const std::string_view name(entry.name);
+    if (name.front() == '.' || name.size() < suffix.size() ||
+        name.substr(name.size() - suffix.size()) != suffix) {
+      continue;
+    }
+    paths.push_back(prefix);
+    paths.back().append(name);
+    // Directories, sockets and the like would fail the whole load.
+    if (!IsRegularFile(entry, paths.back())) {
+      paths.pop_back();
+    }
+  }
+  uv_fs_req_cleanup(&req);
+  // Every path shares the prefix, so this is filename order.
+  std::sort(paths.begin(), paths.end());
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, paths.size());
+  std::vector<std::shared_ptr<const ParsedEntries>> parsed(paths.size());
+  if (threads > 0) {
+    // Start each worker on a contiguous slice; stealing evens them out.
+    std::unique_ptr<WorkRange[]> ranges(new WorkRange[threads]);
+    for (size_t i = 0; i < threads; i++) {
+      ranges[i].Assign(static_cast<uint32_t>(paths.size() * i / threads),
+                       static_cast<uint32_t>(paths.size() * (i + 1) / threads));
+    }
+    // Plain threads rather than the libuv pool: this runs synchronously,
+    // before there is a loop to queue work on.
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; i++) {
+      workers.emplace_back(
+          ParseFragments, &paths, ranges.get(), threads, i, &parsed);
+    }
+    ParseFragments(&paths, ranges.get(), threads, 0, &parsed);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  for (const auto& entries : parsed) {
+    if (entries == nullptr) {
+      return false;
+    }
+  }
+  for (const auto& entries : parsed) {
+    StoreEntries(*entries);
+  }
+  span.set_detail("files", paths.size());
+  return true;
+}
+
+void Dotenv::StoreEntries(const ParsedEntries& entries) {
+  for (const auto& [key, value] : entries) {
+    store_.insert_or_assign(key, value);
+  }
+  InvalidateCaches();
+}
+
+void Dotenv::AssignNodeOptionsIfAvailable(std::string* node_options) {
+  auto match = store_.find("NODE_OPTIONS");
+
+  if (match != store_.end()) {
+    *node_options = match->second;
+  }
+}
+
+namespace {
+bool ParseInt(std::string_view text, int64_t* value) {
+  // from_chars takes a '-' but not a '+'.
+  if (text.size() > 1 && text[0] == '+' &&
+      std::isdigit(static_cast<unsigned char>(text[1]))) {
+    text.remove_prefix(1);
+  }
+  const char* end = text.data() + text.size();
+  const auto [parsed, error] = std::from_chars(text.data(), end, *value);
+  return !text.empty() && error == std::errc() && parsed == end;
+}
+
+bool ParseBool(const std::string_view text, bool* value) {
+  static constexpr std::string_view kTrue[] = {"true", "yes", "on", "1"};
+  static constexpr std::string_view kFalse[] = {"false", "no", "off", "0"};
+  char lower[6];
+  if (text.size() >= sizeof(lower)) {
+    return false;
+  }
+  for (size_t i = 0; i < text.size(); i++) {
+    lower[i] = static_cast<char>(
+        std::tolower(static_cast<unsigned char>(text[i])));
+  }
+  const std::string_view word(lower, text.size());
+  for (size_t i = 0; i < std::size(kTrue); i++) {
+    if (word == kTrue[i] || word == kFalse[i]) {
+      *value = word == kTrue[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseDuration(std::string_view text, int64_t* nanoseconds) {
+  static constexpr struct {
+    std::string_view name;
+    int64_t scale;
+  } kUnits[] = {{"ns", 1},
+                {"us", 1000},
+                {"ms", 1000 * 1000},
+                {"s", 1000 * 1000 * 1000},
+                {"m", 60LL * 1000 * 1000 * 1000},
+                {"h", 60LL * 60 * 1000 * 1000 * 1000},
+                {"d", 24LL * 60 * 60 * 1000 * 1000 * 1000}};
+  // A bare 0 needs no unit.
+  if (text == "0") {
+    *nanoseconds = 0;
+    return true;
+  }
+  if (text.empty()) {
+    return false;
+  }
+  int64_t total = 0;
+  while (!text.empty()) {
+    uint64_t count;
+    const auto [parsed, error] =
+        std::from_chars(text.data(), text.data() + text.size(), count);
+    if (error != std::errc()) {
+      return false;
+    }
+    text.remove_prefix(parsed - text.data());
+    size_t unit_length = 0;
+    while (unit_length < text.size() &&
+           std::isalpha(static_cast<unsigned char>(text[unit_length]))) {
+      unit_length++;
+    }
+    const std::string_view unit = text.substr(0, unit_length);
+    text.remove_prefix(unit_length);
+    int64_t scale = 0;
+    for (const auto& known : kUnits) {
+      if (known.name == unit) {
+        scale = known.scale;
+        break;
+      }
+    }
+    if (scale == 0 || count > static_cast<uint64_t>(INT64_MAX / scale) ||
+        total > INT64_MAX - static_cast<int64_t>(count) * scale) {
+      return false;
+    }
+    total += static_cast<int64_t>(count) * scale;
+  }
+  *nanoseconds = total;
+  return true;
+}
+
+bool ParseBytes(std::string_view text, uint64_t* bytes) {
+  uint64_t count;
+  const auto [parsed, error] =
+      std::from_chars(text.data(), text.data() + text.size(), count);
+  if (error != std::errc()) {
+    return false;
+  }
+  text.remove_prefix(parsed - text.data());
+  int power = 0;
+  if (!text.empty()) {
+    switch (text[0]) {
+      case 'K':
+      case 'k':
+        power = 1;
+        break;
+      case 'M':
+        power = 2;
+        break;
+      case 'G':
+        power = 3;
+        break;
+      case 'T':
+        power = 4;
+        break;
+    }
+  }
+  uint64_t base = 1000;
+  if (power > 0) {
+    text.remove_prefix(1);
+    if (!text.empty() && text[0] == 'i') {
+      base = 1024;
+      text.remove_prefix(1);
+    }
+  }
+  if (text == "B") {
+    text.remove_prefix(1);
+  }
+  if (!text.empty()) {
+    return false;
+  }
+  for (int i = 0; i < power; i++) {
+    if (count > UINT64_MAX / base) {
+      return false;
+    }
+    count *= base;
+  }
+  *bytes = count;
+  return true;
+}
+}  // namespace
+
+Dotenv::TypedGeneration::TypedGeneration(TypedGeneration&& other) noexcept
+  : value_(other.value_) {
+  other.Advance();
+}
+
+Dotenv::TypedGeneration& Dotenv::TypedGeneration::operator=(
+    TypedGeneration&& other) noexcept {
+  value_ = other.value_;
+  other.Advance();
+  return *this;
+}
+
+uint64_t Dotenv::TypedGeneration::Next() {
+  // Unique across every Dotenv, so a TypedKey used with another one misses.
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The cache slot for key, made on first use. Keys that aren't set get none,
+// so looking up misses can't grow the cache.
+Dotenv::TypedValue* Dotenv::FindTyped(const std::string_view key) {
+  const auto typed = typed_values_.find(key);
+  if (typed != typed_values_.end()) {
+    return &typed->second;
+  }
+  const auto match = store_.find(std::string(key));
+  if (match == store_.end()) {
+    return nullptr;
+  }
+  TypedValue* entry = &typed_values_.emplace(match->first, TypedValue())
+                           .first->second;
+  entry->text = &match->second;
+  return entry;
+}
+
+const Dotenv::TypedValue* Dotenv::Convert(TypedValue* entry,
+                                          const TypedKind kind) {
+  if ((entry->converted & kind) != 0) {
+    return entry;
+  }
+  entry->converted |= kind;
+  const std::string_view text = *entry->text;
+  bool converted = false;
+  switch (kind) {
+    case kInt:
+      converted = ParseInt(text, &entry->integer);
+      break;
+    case kBool:
+      converted = ParseBool(text, &entry->boolean);
+      break;
+    case kDuration:
+      converted = ParseDuration(text, &entry->nanoseconds);
+      break;
+    case kBytes:
+      converted = ParseBytes(text, &entry->bytes);
+      break;
+  }
+  if (converted) {
+    entry->valid |= kind;
+  }
+  return entry;
+}
+
+const Dotenv::TypedValue* Dotenv::ConvertOnce(const std::string_view key,
+                                              const TypedKind kind) {
+  TypedValue* entry = FindTyped(key);
+  return entry == nullptr ? nullptr : Convert(entry, kind);
+}
+
+const Dotenv::TypedValue* Dotenv::ConvertOnce(TypedKey* key,
+                                              const TypedKind kind) {
+  if (key->generation_ != typed_generation_.value()) {
+    key->slot_ = FindTyped(key->key_);
+    key->generation_ = typed_generation_.value();
+  }
+  return key->slot_ == nullptr ? nullptr : Convert(key->slot_, kind);
+}
+
+bool Dotenv::GetInt(const std::string_view key, int64_t* value) {
+  const TypedValue* typed = ConvertOnce(key, kInt);
+  if (typed == nullptr || (typed->valid & kInt) == 0) {
+    return false;
+  }
+  *value = typed->integer;
+  return true;
+}
+
+bool Dotenv::GetInt(TypedKey* key, int64_t* value) {
+  const TypedValue* typed = ConvertOnce(key, kInt);
+  if (typed == nullptr || (typed->valid & kInt) == 0) {
+    return false;
+  }
+  *value = typed->integer;
+  return true;
+}
+
+bool Dotenv::GetBool(const std::string_view key, bool* value) {
+  const TypedValue* typed = ConvertOnce(key, kBool);
+  if (typed == nullptr || (typed->valid & kBool) == 0) {
+    return false;
+  }
+  *value = typed->boolean;
+  return true;
+}
+
+bool Dotenv::GetBool(TypedKey* key, bool* value) {
+  const TypedValue* typed = ConvertOnce(key, kBool);
+  if (typed == nullptr || (typed->valid & kBool) == 0) {
+    return false;
+  }
+  *value = typed->boolean;
+  return true;
+}
+
+bool Dotenv::GetDuration(const std::string_view key,
+                         std::chrono::nanoseconds* value) {
+  const TypedValue* typed = ConvertOnce(key, kDuration);
+  if (typed == nullptr || (typed->valid & kDuration) == 0) {
+    return false;
+  }
+  *value = std::chrono::nanoseconds(typed->nanoseconds);
+  return true;
+}
+
+bool Dotenv::GetDuration(TypedKey* key, std::chrono::nanoseconds* value) {
+  const TypedValue* typed = ConvertOnce(key, kDuration);
+  if (typed == nullptr || (typed->valid & kDuration) == 0) {
+    return false;
+  }
+  *value = std::chrono::nanoseconds(typed->nanoseconds);
+  return true;
+}
+
+bool Dotenv::GetBytes(const std::string_view key, uint64_t* value) {
+  const TypedValue* typed = ConvertOnce(key, kBytes);
+  if (typed == nullptr || (typed->valid & kBytes) == 0) {
+    return false;
+  }
+  *value = typed->bytes;
+  return true;
+}
+
+bool Dotenv::GetBytes(TypedKey* key, uint64_t* value) {
+  const TypedValue* typed = ConvertOnce(key, kBytes);
+  if (typed == nullptr || (typed->valid & kBytes) == 0) {
+    return false;
+  }
+  *value = typed->bytes;
+  return true;
+}
+
+void Dotenv::ParseLine(const std::string_view line) {
+  auto equal_index = line.find('=');
+
+  if (equal_index == std::string_view::npos) {
+    return;
+  }
+
+  auto key = line.substr(0, equal_index);
+
+  // Remove leading and trailing space characters from key.
+  while (!key.empty() && std::isspace(key.front())) key.remove_prefix(1);
+  while (!key.empty() && std::isspace(key.back())) key.remove_suffix(1);
+
+  // Omit lines with comments
+  if (key.front() == '#' || key.empty()) {
+    return;
+  }
+
+  auto value = std::string(line.substr(equal_index + 1));
+
+  // Might start and end with `"' characters.
+  auto quotation_index = value.find_first_of("`\"'");
+
+  if (quotation_index == 0) {
+    auto quote_character = value[quotation_index];
+    value.erase(0, 1);
+
+    auto end_quotation_index = value.find_last_of(quote_character);
+
+    // We couldn't find the closing quotation character. Terminate.
+    if (end_quotation_index == std::string::npos) {
+      return;
+    }
+
+    value.erase(end_quotation_index);
+  } else {
+    auto hash_index = value.find('#');
+
+    // Remove any inline comments
+    if (hash_index != std::string::npos) {
+      value.erase(hash_index);
+    }
+
+    // Remove any leading/trailing spaces from unquoted values.
+    while (!value.empty() && std::isspace(value.front())) value.erase(0, 1);
+    while (!value.empty() && std::isspace(value.back()))
+      value.erase(value.size() - 1);
+  }
+
+  store_.insert_or_assign(std::string(key), value);
+  InvalidateCaches();
+}
+
+}  // namespace node
+
+
+namespace cppnv {
+namespace {
+constexpr uint64_t kEveryByte = 0x0101010101010101ULL;
+constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+
+// Non-zero when any byte of word equals byte.
+constexpr uint64_t has_byte(const uint64_t word, const uint8_t byte) {
+  const uint64_t x = word ^ (kEveryByte * byte);
+  return (x - kEveryByte) & ~x & kHighBits;
+}
+
+// Index of the first byte in data that is one of Bytes or has its high bit
+// set, or length if there is none. Scans a word at a time.
+template <char... Bytes>
+size_t find_special(const char* data, const size_t length) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    const uint64_t matches = (uint64_t{0} | ... | has_byte(word, Bytes));
+    if (((word & kHighBits) | matches) != 0) {
+      break;
+    }
+  }
+  for (; i < length; i++) {
+    const char c = data[i];
+    if (c < 0 || (false || ... || (c == Bytes))) {
+      return i;
+    }
+  }
+  return length;
+}
+
+// What a reference resolves to, given the value found for its name in the
+// file (null when no pair defines it): that value, else the environment's,
+// else the reference's default. Returns false to leave it as written.
+bool pick_replacement(const VariablePosition& interpolation,
+                      const std::string& text,
+                      const std::string* found,
+                      const EnvironmentSnapshot* environment,
+                      std::string* replacement) {
+  std::string_view value;
+  bool defined = found != nullptr;
+  if (defined) {
+    value = *found;
+  } else if (environment != nullptr) {
+    const int length =
+        interpolation.variable_end - interpolation.variable_start + 1;
+    defined = environment->find(
+        std::string_view(text).substr(interpolation.variable_start,
+                                      std::max(0, length)),
+        &value);
+  }
+  if (interpolation.default_start >= 0 &&
+      (!defined || (interpolation.default_if_empty && value.empty()))) {
+    replacement->assign(text, interpolation.default_start,
+                        interpolation.default_end -
+                        interpolation.default_start);
+    return true;
+  }
+  if (!defined) {
+    return false;
+  }
+  replacement->assign(value);
+  return true;
+}
+
+// What read_key would turn into something else: surrounding spaces are
+// trimmed, carriage returns dropped, '=', '#' and newlines end the key, and
+// high bit bytes end the stream.
+bool is_writable_key(const std::string_view key) {
+  if (!key.empty() && (key.front() == ' ' || key.back() == ' ')) {
+    return false;
+  }
+  return find_special<'=', '#', '\n', '\r'>(key.data(), key.size()) ==
+         key.size();
+}
+
+// A '{' whose previous non-space character is an unescaped '$' opens a
+// variable in bare and double quoted values.
+bool has_interpolation_syntax(const std::string_view value) {
+  for (size_t i = value.find('{'); i != std::string_view::npos;
+       i = value.find('{', i + 1)) {
+    size_t dollar = i;
+    while (dollar > 0 && value[dollar - 1] == ' ') {
+      dollar--;
+    }
+    if (dollar > 0 && value[dollar - 1] == '$' &&
+        (dollar < 2 || value[dollar - 2] != '\\')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+char escape_code(const char c) {
+  switch (c) {
+    case '\\':
+      return '\\';
+    case '"':
+      return '"';
+    case '\n':
+      return 'n';
+    case '\r':
+      return 'r';
+    case '\t':
+      return 't';
+    case '\b':
+      return 'b';
+    case '\v':
+      return 'v';
+    case '\a':
+      return 'a';
+    default:
+      return 0;
+  }
+}
+
+// Backslashes, comments and interpolation braces need the full state
+// machine, and so do bytes with the high bit set since the stream hands
+// them out as negative chars, which end the read.
+bool has_special_characters(const char* data, const size_t length) {
+  return find_special<'\\', '#', '{'>(data, length) != length;
+}
+
+// ${a-b} is also how a key named a-b is referenced. When the whole text
+// names a defined key or environment variable the reference is to that,
+// and only otherwise does the dash start a default.
+template <typename IsDefined>
+void settle_default(VariablePosition* interpolation,
+                    const std::string& text,
+                    const EnvironmentSnapshot* environment,
+                    const IsDefined& is_defined) {
+  if (interpolation->default_start < 0) {
+    return;
+  }
+  const std::string_view whole = std::string_view(text).substr(
+      interpolation->variable_start,
+      interpolation->default_end - interpolation->variable_start);
+  std::string_view unused;
+  if (!is_defined(whole) &&
+      (environment == nullptr || !environment->find(whole, &unused))) {
+    return;
+  }
+  interpolation->variable_end = interpolation->default_end - 1;
+  interpolation->default_start = -1;
+  interpolation->default_end = -1;
+  interpolation->default_if_empty = false;
+}
+}  // namespace
+
+VariablePosition::VariablePosition(const int variable_start,
+                                   const int start_brace,
+                                   const int dollar_sign)
+  : variable_start(
+        variable_start),
+    start_brace(start_brace),
+    dollar_sign(dollar_sign),
+    end_brace(0),
+    variable_end(0) {
+}
+cppnv::EnvStream::EnvStream(std::string* data) {
+  this->data_ = data;
+  this->length_ = this->data_->length();
+  this->is_good_ = this->index_ < this->length_;
+}
+
+cppnv::EnvStream::EnvStream(std::string* data,
+                             const size_t start,
+                             const size_t end)
+  : EnvStream(data) {
+  this->length_ = std::min(end, this->length_);
+  skip(std::min(start, this->length_));
+}
+
+char cppnv::EnvStream::get() {
+  if (this->index_ >= this->length_) {
+    return -1;
+  }
+  const auto ret = this->data_->at(this->index_);
+  this->index_++;
+  this->is_good_ = this->index_ < this->length_;
+  return ret;
+}
+
+bool cppnv::EnvStream::good() const {
+  return this->is_good_;
+}
+
+bool cppnv::EnvStream::eof() const {
+  return !good();
+}
+
+const char* cppnv::EnvStream::cursor() const {
+  return this->data_->data() + this->index_;
+}
+
+size_t cppnv::EnvStream::remaining() const {
+  return this->length_ - this->index_;
+}
+
+size_t cppnv::EnvStream::position() const {
+  return this->index_;
+}
+
+void cppnv::EnvStream::skip(const size_t count) {
+  this->index_ += count;
+  this->is_good_ = this->index_ < this->length_;
+}
+
+EnvironmentSnapshot::EnvironmentSnapshot(const char* const* envp) {
+  if (envp == nullptr) {
+#ifdef _WIN32
+    envp = _environ;
+#else
+    envp = environ;
+#endif
+  }
+  // Sized up front so the views into buffer_ stay valid.
+  size_t size = 0;
+  size_t count = 0;
+  for (const char* const* entry = envp; *entry != nullptr; entry++) {
+    size += strlen(*entry);
+    count++;
+  }
+  buffer_.reserve(size);
+  values_.reserve(count);
+  for (const char* const* entry = envp; *entry != nullptr; entry++) {
+    const size_t length = strlen(*entry);
+    const char* equal = static_cast<const char*>(memchr(*entry, '=', length));
+    if (equal == nullptr) {
+      continue;
+    }
+    const char* start = buffer_.data() + buffer_.size();
+    buffer_.append(*entry, length);
+    const size_t name_length = equal - *entry;
+    values_.emplace(std::string_view(start, name_length),
+                    std::string_view(start + name_length + 1,
+                                     length - name_length - 1));
+  }
+}
+
+bool EnvironmentSnapshot::find(const std::string_view name,
+                               std::string_view* value) const {
+  const auto match = values_.find(name);
+  if (match == values_.end()) {
+    return false;
+  }
+  *value = match->second;
+  return true;
+}
+
+/**
+ * \brief Reads a plain KEY=value line without going through the character
+ * state machine. Only lines with no quoted value, escape, comment or
+ * interpolation qualify; the result is the same as read_pair would give.
+ * \return false, without consuming anything, if the line isn't simple
+ */
+bool EnvReader::read_simple_pair(EnvStream* file, const EnvPair* pair) {
+  const char* line = file->cursor();
+  const size_t remaining = file->remaining();
+  const auto newline =
+      static_cast<const char*>(memchr(line, '\n', remaining));
+  const size_t line_length =
+      newline == nullptr ? remaining : static_cast<size_t>(newline - line);
+  const auto equal = static_cast<const char*>(memchr(line, '=', line_length));
+  // A '=' that ends the stream is left to read_key.
+  if (equal == nullptr ||
+      (newline == nullptr && equal == line + remaining - 1)) {
+    return false;
+  }
+  if (has_special_characters(line, line_length)) {
+    return false;
+  }
+  const char* line_end = line + line_length;
+  if (equal + 1 < line_end &&
+      (equal[1] == '"' || equal[1] == '\'' || equal[1] == '`')) {
+    return false;
+  }
+  // read_key drops carriage returns anywhere in the key.
+  if (memchr(line, '\r', equal - line) != nullptr) {
+    return false;
+  }
+
+  const char* key_start = line;
+  const char* key_end = equal;
+  while (key_start < key_end && *key_start == ' ') {
+    key_start++;
+  }
+  while (key_end > key_start && key_end[-1] == ' ') {
+    key_end--;
+  }
+  const char* value_start = equal + 1;
+  const char* value_end = line_end;
+  while (value_start < value_end && *value_start == ' ') {
+    value_start++;
+  }
+  if (newline != nullptr && value_end > value_start &&
+      value_end[-1] == '\r') {
+    value_end--;
+  }
+  while (value_end > value_start && value_end[-1] == ' ') {
+    value_end--;
+  }
+
+  const size_t key_length = key_end - key_start;
+  if (pair->key->has_own_buffer()) {
+    pair->key->own_buffer->assign(key_start, key_length);
+  } else {
+    pair->key->set_own_buffer(new std::string(key_start, key_length));
+  }
+  pair->key->key_index = static_cast<int>(key_length);
+
+  const size_t value_length = value_end - value_start;
+  if (pair->value->has_own_buffer()) {
+    pair->value->own_buffer->assign(value_start, value_length);
+  } else {
+    pair->value->set_own_buffer(new std::string(value_start, value_length));
+  }
+  pair->value->value_index = static_cast<int>(value_length);
+  pair->value->double_quoted = true;
+  pair->value->implicit_double_quote = true;
+
+  file->skip(line_length + (newline == nullptr ? 0 : 1));
+  return true;
+}
+template <typename Dialect>
+EnvReader::read_result EnvReader::read_pair(EnvStream* file,
+                                            const EnvPair* pair) {
+  if (read_simple_pair(file, pair)) {
+    if (pair->value->sink != nullptr) {
+      pair->value->sink_key = pair->key->key;
+      finish_sink(pair->value);
+      pair->value->clip_own_buffer(pair->value->value_index);
+    }
+    return success;
+  }
   const read_result result = read_key(file, pair->key);
   if (result == fail || result == empty) {
     return fail;
   }
-  if (result == comment_encountered) {
-    return comment_encountered;
+  if (result == comment_encountered) {
+    return comment_encountered;
+  }
+  if (result == end_of_stream_key) {
+    return end_of_stream_key;
+  }
+
+  //  trim right side of key
+  while (pair->key->key_index > 0) {
+    if (pair->key->key->at(pair->key->key_index - 1) != ' ') {
+      break;
+    }
+    pair->key->key_index--;
+  }
+  if (!pair->key->has_own_buffer()) {
+    const auto tmp_str = new std::string(pair->key->key_index, '\0');
+
+    tmp_str->replace(0,
+                     pair->key->key_index,
+                     *pair->key->key,
+                     0,
+                     pair->key->key_index);
+
+    pair->key->set_own_buffer(tmp_str);;
+  } else {
+    pair->key->clip_own_buffer(pair->key->key_index);
+  }
+  if (result == end_of_stream_value) {
+    // The stream ended right after the '=', so the value is empty. It still
+    // needs its own buffer, the shared one is reused for the next pair.
+    if (!pair->value->has_own_buffer()) {
+      pair->value->set_own_buffer(new std::string());
+    } else {
+      pair->value->clip_own_buffer(0);
+    }
+    return success;
+  }
+  pair->value->value->clear();
+  pair->value->sink_key = pair->key->key;
+  const read_result value_result =
+      read_value<Dialect>(file, pair->value);
+  if (pair->value->sink != nullptr) {
+    finish_sink(pair->value);
+  }
+  if (value_result == end_of_stream_value) {
+    return end_of_stream_value;
+  }
+  if (value_result == comment_encountered || value_result == success) {
+    if (!pair->value->has_own_buffer()) {
+      const auto tmp_str =
+          new std::string(pair->value->value_index, '\0');
+
+      tmp_str->replace(0,
+                       pair->value->value_index,
+                       *pair->value->value,
+                       0,
+                       pair->value->value_index);
+
+      pair->value->
+            set_own_buffer(tmp_str);
+    } else {
+      pair->value->clip_own_buffer(pair->value->value_index);
+    }
+    remove_unclosed_interpolation(pair->value);
+    return success;
+  }
+  if (value_result == empty) {
+    remove_unclosed_interpolation(pair->value);
+    return empty;
+  }
+  if (value_result == end_of_stream_key) {
+    remove_unclosed_interpolation(pair->value);
+    return end_of_stream_key;
+  }
+
+  remove_unclosed_interpolation(pair->value);
+  return fail;
+}
+
+
+template <typename Dialect>
+int EnvReader::read_pairs(EnvStream* file,
+                          std::vector<EnvPair*>* pairs,
+                          EnvValueSink* sink) {
+  CPPNV_PROBE1(read_pairs__start, file->remaining());
+  TraceSpan span("read_pairs");
+  int count = 0;
+  auto buffer = std::string(256, '\0');
+
+  while (true) {
+    buffer.clear();
+    EnvPair* pair = new EnvPair();
+    pair->key = new EnvKey();
+    pair->key->key = &buffer;
+    pair->value = new EnvValue();
+    pair->value->value = &buffer;
+    pair->value->sink = sink;
+    const read_result result = read_pair<Dialect>(file, pair);
+    if (result == end_of_stream_value) {
+      pairs->push_back(pair);
+      count++;
+      break;
+    }
+    if (result == success) {
+      pairs->push_back(pair);
+      count++;
+      continue;
+    }
+
+    delete pair->key;
+    delete pair->value;
+    delete pair;
+    if (result == comment_encountered || result == fail) {
+      continue;
+    }
+    break;
+  }
+
+  CPPNV_PROBE1(read_pairs__done, count);
+  span.set_detail("pairs", count);
+  return count;
+}
+
+int EnvReader::read_pairs(EnvStream* file, EnvPairTable* table) {
+  int count = 0;
+  auto buffer = std::string(256, '\0');
+  // One pair is read into over and over; after the first read it owns its
+  // key and value buffers, so their capacity is reused.
+  EnvPair pair{};
+  EnvKey key;
+  EnvValue value;
+  pair.key = &key;
+  pair.value = &value;
+
+  while (true) {
+    buffer.clear();
+    key.reset();
+    value.reset();
+    if (!key.has_own_buffer()) {
+      key.key = &buffer;
+    }
+    if (!value.has_own_buffer()) {
+      value.value = &buffer;
+    }
+    const read_result result = read_pair(file, &pair);
+    if (result == success || result == end_of_stream_value) {
+      table->append(&pair);
+      count++;
+      if (result == end_of_stream_value) {
+        break;
+      }
+      continue;
+    }
+    if (result == comment_encountered || result == fail) {
+      continue;
+    }
+    break;
+  }
+
+  return count;
+}
+
+EnvSectionIndex::EnvSectionIndex(const std::string_view text)
+  : preamble_end_(text.size()) {
+  const char* const begin = text.data();
+  const char* const end = begin + text.size();
+  std::vector<std::pair<size_t, size_t>>* open = nullptr;
+  for (const char* line = begin; line < end;) {
+    const auto newline =
+        static_cast<const char*>(memchr(line, '\n', end - line));
+    const char* line_end = newline == nullptr ? end : newline;
+    const char* next = newline == nullptr ? end : newline + 1;
+
+    const char* name = line;
+    while (name < line_end && (*name == ' ' || *name == '\t')) {
+      name++;
+    }
+    if (name == line_end || *name != '[') {
+      line = next;
+      continue;
+    }
+    name++;
+    const char* close = name;
+    while (close < line_end && *close != ']' && *close != '[') {
+      close++;
+    }
+    const char* rest = close + 1;
+    while (rest < line_end && (*rest == ' ' || *rest == '\t' ||
+                               *rest == '\r')) {
+      rest++;
+    }
+    if (close == line_end || *close != ']' || close == name ||
+        rest != line_end) {
+      line = next;
+      continue;
+    }
+
+    if (open == nullptr) {
+      preamble_end_ = line - begin;
+    } else {
+      open->back().second = line - begin;
+    }
+    open = &sections_[std::string(name, close - name)];
+    open->emplace_back(next - begin, text.size());
+    line = next;
   }
-  if (result == end_of_stream_key) {
-    return end_of_stream_key;
+}
+
+const std::vector<std::pair<size_t, size_t>>* EnvSectionIndex::find(
+    const std::string_view name) const {
+  const auto match = sections_.find(std::string(name));
+  return match == sections_.end() ? nullptr : &match->second;
+}
+
+bool EnvReader::read_profile(std::string* text,
+                             const EnvSectionIndex& index,
+                             const std::string_view profile,
+                             std::vector<EnvPair*>* pairs) {
+  const auto* sections = index.find(profile);
+  if (sections == nullptr) {
+    return false;
+  }
+  const size_t first = pairs->size();
+  EnvStream preamble(text, 0, index.preamble_end());
+  read_pairs(&preamble, pairs);
+  const size_t shared_end = pairs->size();
+  for (const auto& [start, end] : *sections) {
+    EnvStream section(text, start, end);
+    read_pairs(&section, pairs);
   }
 
-  if (result == end_of_stream_value) {
-    return success;
+  std::unordered_set<std::string_view> overridden;
+  for (size_t i = shared_end; i < pairs->size(); i++) {
+    overridden.insert(*(*pairs)[i]->key->key);
   }
-  //  trim right side of key
-  while (pair->key->key_index > 0) {
-    if (pair->key->key->at(pair->key->key_index - 1) != ' ') {
+  size_t kept = first;
+  for (size_t i = first; i < pairs->size(); i++) {
+    EnvPair* pair = (*pairs)[i];
+    if (i < shared_end && overridden.count(*pair->key->key) != 0) {
+      delete_pair(pair);
+      continue;
+    }
+    (*pairs)[kept++] = pair;
+  }
+  pairs->resize(kept);
+  return true;
+}
+
+EnvPairReader::EnvPairReader(EnvStream* file)
+  : file_(file), buffer_(256, '\0') {
+}
+
+EnvPair* EnvPairReader::next() {
+  while (!done_) {
+    buffer_.clear();
+    EnvPair* pair = new EnvPair();
+    pair->key = new EnvKey();
+    pair->key->key = &buffer_;
+    pair->value = new EnvValue();
+    pair->value->value = &buffer_;
+    const EnvReader::read_result result = EnvReader::read_pair(file_, pair);
+    if (result == EnvReader::success ||
+        result == EnvReader::end_of_stream_value) {
+      done_ = result == EnvReader::end_of_stream_value;
+      if (pair->value->interpolations.empty()) {
+        EnvReader::finalize_value(pair, nullptr);
+      }
+      return pair;
+    }
+
+    EnvReader::delete_pair(pair);
+    if (result != EnvReader::comment_encountered &&
+        result != EnvReader::fail) {
+      done_ = true;
+    }
+  }
+  return nullptr;
+}
+
+EnvPairResolver::EnvPairResolver(EnvStream* file,
+                                 const EnvironmentSnapshot* environment)
+  : reader_(file), file_(file), environment_(environment) {
+  scan_references();
+}
+
+// Reads every {...} left in the stream as a reference, named the way
+// close_variable names it: the text trimmed of spaces and, when it has a
+// dash, the part before it too. That finds more than the reader will (braces
+// in single quotes or comments), which only keeps definitions longer. An
+// escape inside the braces changes the name the reader sees, so then every
+// definition is kept instead.
+void EnvPairResolver::scan_references() {
+  const std::string_view text(file_->cursor(), file_->remaining());
+  const size_t start = file_->position();
+  const auto trim = [](std::string_view name) {
+    while (!name.empty() && name.front() == ' ') {
+      name.remove_prefix(1);
+    }
+    while (!name.empty() && name.back() == ' ') {
+      name.remove_suffix(1);
+    }
+    return name;
+  };
+  for (size_t open = text.find('{'); open != std::string_view::npos;
+       open = text.find('{', open + 1)) {
+    const size_t close = text.find('}', open + 1);
+    if (close == std::string_view::npos) {
       break;
     }
-    pair->key->key_index--;
+    const std::string_view name =
+        trim(text.substr(open + 1, close - open - 1));
+    if (name.find_first_of("\\{") != std::string_view::npos) {
+      keep_definitions_ = true;
+      last_references_.clear();
+      return;
+    }
+    last_references_[std::string(name)] = start + open;
+    const size_t dash = name.find('-');
+    if (dash == std::string_view::npos) {
+      continue;
+    }
+    std::string_view split = name.substr(0, dash);
+    if (!split.empty() && split.back() == ':') {
+      split.remove_suffix(1);
+    }
+    last_references_[std::string(trim(split))] = start + open;
   }
-  if (!pair->key->has_own_buffer()) {
-    const auto tmp_str = new std::string(pair->key->key_index, '\0');
+}
 
-    tmp_str->replace(0,
-                     pair->key->key_index,
-                     *pair->key->key,
-                     0,
-                     pair->key->key_index);
+EnvPairResolver::~EnvPairResolver() {
+  for (size_t i = ready_index_; i < ready_.size(); i++) {
+    EnvReader::delete_pair(ready_[i]);
+  }
+  for (const Pending& pending : pending_) {
+    if (pending.pair != nullptr) {
+      EnvReader::delete_pair(pending.pair);
+    }
+  }
+}
 
-    pair->key->set_own_buffer(tmp_str);;
-  } else {
-    pair->key->clip_own_buffer(pair->key->key_index);
+EnvPair* EnvPairResolver::next() {
+  while (true) {
+    if (ready_index_ < ready_.size()) {
+      return ready_[ready_index_++];
+    }
+    ready_.clear();
+    ready_index_ = 0;
+    if (flushed_) {
+      return nullptr;
+    }
+    // Nothing from here on references what expires before it.
+    position_ = file_->position();
+    while (!expiring_.empty() && expiring_.begin()->first < position_) {
+      const auto definition = definitions_.find(expiring_.begin()->second);
+      if (definition != definitions_.end()) {
+        release(definition);
+      }
+      expiring_.erase(expiring_.begin());
+    }
+    EnvPair* pair = reader_.next();
+    if (pair == nullptr) {
+      flush();
+      flushed_ = true;
+      continue;
+    }
+    add(pair);
   }
-  pair->value->value->clear();
-  const read_result value_result = read_value(file, pair->value);
-  if (value_result == end_of_stream_value) {
-    return end_of_stream_value;
+}
+
+void EnvPairResolver::add(EnvPair* pair) {
+  const auto [definition, inserted] =
+      definitions_.try_emplace(*pair->key->key);
+  if (inserted) {
+    definition->second.first = pair;
+  }
+  if (pair->value->is_already_interpolated) {
+    resolve(pair);
+    return;
   }
-  if (value_result == comment_encountered || value_result == success) {
-    if (!pair->value->has_own_buffer()) {
-      const auto tmp_str =
-          new std::string(pair->value->value_index, '\0');
 
-      tmp_str->replace(0,
-                       pair->value->value_index,
-                       *pair->value->value,
-                       0,
-                       pair->value->value_index);
+  const auto is_defined = [this](const std::string_view name) {
+    return definitions_.count(std::string(name)) != 0;
+  };
+  size_t missing = 0;
+  const std::string_view value(*pair->value->value);
+  for (VariablePosition& interpolation : pair->value->interpolations) {
+    settle_default(&interpolation, *pair->value->value, environment_,
+                   is_defined);
+    if (interpolation.default_start >= 0) {
+      // A key named like the whole reference may still come further down, so
+      // where the name ends isn't known until it does or the stream ends.
+      waiters_[std::string(value.substr(
+          interpolation.variable_start,
+          interpolation.default_end - interpolation.variable_start))]
+          .push_back(pending_.size());
+      missing++;
+      continue;
+    }
+    const int length =
+        interpolation.variable_end - interpolation.variable_start + 1;
+    std::string name(
+        value.substr(interpolation.variable_start, std::max(0, length)));
+    const auto match = definitions_.find(name);
+    if (match != definitions_.end() && match->second.resolved) {
+      continue;
+    }
+    waiters_[std::move(name)].push_back(pending_.size());
+    missing++;
+  }
+  if (missing == 0) {
+    resolve(pair);
+    return;
+  }
+  pending_.push_back({pair, missing});
+  pending_count_++;
+  mention(pair, true);
+}
 
-      pair->value->
-            set_own_buffer(tmp_str);
+// Finalizes pair and queues it, then every pending pair that was only
+// waiting on it, in the order they become ready.
+void EnvPairResolver::resolve(EnvPair* pair) {
+  const size_t first_ready = ready_.size();
+  ready_.push_back(pair);
+  for (size_t i = first_ready; i < ready_.size(); i++) {
+    const EnvPair* ready = ready_[i];
+    if (i > first_ready) {
+      // Everything after the first was pending.
+      mention(ready, false);
+    }
+    substitute(ready);
+    const auto definition = definitions_.find(*ready->key->key);
+    if (definition == definitions_.end() || definition->second.resolved ||
+        definition->second.first != ready) {
+      continue;
+    }
+    definition->second.resolved = true;
+    const auto waiters = waiters_.find(definition->first);
+    if (waiters != waiters_.end() || needed(definition->first)) {
+      definition->second.value = *ready->value->value;
+    }
+    if (!keep_definitions_) {
+      const auto last = last_references_.find(definition->first);
+      if (last != last_references_.end() && last->second >= position_) {
+        expiring_.emplace(last->second, definition->first);
+      }
+      if (!definition->second.releasing) {
+        definition->second.releasing = true;
+        releasing_.push_back(definition);
+      }
+    }
+
+    if (waiters == waiters_.end()) {
+      continue;
+    }
+    for (const size_t index : waiters->second) {
+      Pending& pending = pending_[index];
+      if (--pending.missing == 0) {
+        ready_.push_back(pending.pair);
+        pending.pair = nullptr;
+        pending_count_--;
+      }
+    }
+    waiters_.erase(waiters);
+  }
+  for (const Definitions::iterator definition : releasing_) {
+    definition->second.releasing = false;
+    release(definition);
+  }
+  releasing_.clear();
+  if (pending_count_ == 0) {
+    pending_.clear();
+    waiters_.clear();
+  }
+}
+
+// Counts the names pair references, or stops counting them once it is no
+// longer pending. A defaulted reference that isn't settled yet counts for
+// both names it could turn out to be.
+void EnvPairResolver::mention(const EnvPair* pair, const bool add) {
+  if (keep_definitions_) {
+    return;
+  }
+  const std::string_view value(*pair->value->value);
+  for (const VariablePosition& interpolation : pair->value->interpolations) {
+    const int length =
+        interpolation.variable_end - interpolation.variable_start + 1;
+    std::string_view names[2] = {
+        value.substr(interpolation.variable_start, std::max(0, length))};
+    size_t count = 1;
+    if (interpolation.default_start >= 0) {
+      names[count++] = value.substr(
+          interpolation.variable_start,
+          interpolation.default_end - interpolation.variable_start);
+    }
+    for (size_t i = 0; i < count; i++) {
+      std::string name(names[i]);
+      if (add) {
+        mentions_[std::move(name)]++;
+        continue;
+      }
+      const auto mentions = mentions_.find(name);
+      if (--mentions->second != 0) {
+        continue;
+      }
+      mentions_.erase(mentions);
+      const auto definition = definitions_.find(name);
+      if (definition != definitions_.end() &&
+          !definition->second.releasing) {
+        definition->second.releasing = true;
+        releasing_.push_back(definition);
+      }
+    }
+  }
+}
+
+bool EnvPairResolver::needed(const std::string& name) const {
+  if (keep_definitions_ || mentions_.count(name) != 0) {
+    return true;
+  }
+  const auto last = last_references_.find(name);
+  return last != last_references_.end() && last->second >= position_;
+}
+
+// Drops a resolved definition nothing can reference any more.
+void EnvPairResolver::release(const Definitions::iterator definition) {
+  if (definition->second.resolved && !needed(definition->first)) {
+    definitions_.erase(definition);
+  }
+}
+
+// Replaces the references that have a resolved definition, last one first so
+// the earlier positions stay valid.
+void EnvPairResolver::substitute(const EnvPair* pair) const {
+  EnvValue* value = pair->value;
+  if (value->is_already_interpolated) {
+    return;
+  }
+  const auto is_defined = [this](const std::string_view name) {
+    return definitions_.count(std::string(name)) != 0;
+  };
+  for (size_t i = value->interpolations.size(); i-- > 0;) {
+    VariablePosition& interpolation = value->interpolations[i];
+    settle_default(&interpolation, *value->value, environment_, is_defined);
+    const int length =
+        interpolation.variable_end - interpolation.variable_start + 1;
+    const auto match = definitions_.find(value->value->substr(
+        interpolation.variable_start, std::max(0, length)));
+    if (match == definitions_.end() || !match->second.resolved) {
+      continue;
+    }
+    std::string replacement;
+    if (pick_replacement(interpolation, *value->value, &match->second.value,
+                         nullptr, &replacement)) {
+      value->value->replace(interpolation.dollar_sign,
+                            interpolation.end_brace -
+                            interpolation.dollar_sign + 1,
+                            replacement);
+    }
+  }
+  value->is_already_interpolated = true;
+}
+
+// What is still pending references unknown keys or sits on a cycle. The
+// resolved keys it references are stood in ahead of it so finalize_pairs
+// sees the same first definitions the stream did.
+void EnvPairResolver::flush() {
+  if (pending_count_ == 0) {
+    return;
+  }
+  const auto is_defined = [this](const std::string_view name) {
+    return definitions_.count(std::string(name)) != 0;
+  };
+  std::vector<EnvPair*> pairs;
+  std::unordered_set<const Definition*> stood_in;
+  for (const Pending& pending : pending_) {
+    if (pending.pair == nullptr) {
+      continue;
+    }
+    EnvValue* value = pending.pair->value;
+    for (VariablePosition& interpolation : value->interpolations) {
+      settle_default(&interpolation, *value->value, environment_, is_defined);
+      const int length =
+          interpolation.variable_end - interpolation.variable_start + 1;
+      const auto match = definitions_.find(value->value->substr(
+          interpolation.variable_start, std::max(0, length)));
+      if (match == definitions_.end() || !match->second.resolved ||
+          !stood_in.insert(&match->second).second) {
+        continue;
+      }
+      auto* stand_in = new EnvPair();
+      stand_in->key = new EnvKey();
+      stand_in->key->set_own_buffer(new std::string(match->first));
+      stand_in->value = new EnvValue();
+      stand_in->value->set_own_buffer(new std::string(match->second.value));
+      stand_in->value->is_already_interpolated = true;
+      pairs.push_back(stand_in);
+    }
+  }
+  const size_t stand_ins = pairs.size();
+  for (Pending& pending : pending_) {
+    if (pending.pair != nullptr) {
+      pairs.push_back(pending.pair);
+      pending.pair = nullptr;
+    }
+  }
+
+  EnvReader::finalize_pairs(&pairs, nullptr, environment_);
+  for (size_t i = 0; i < pairs.size(); i++) {
+    if (i < stand_ins) {
+      EnvReader::delete_pair(pairs[i]);
     } else {
-      pair->value->clip_own_buffer(pair->value->value_index);
+      ready_.push_back(pairs[i]);
     }
-    remove_unclosed_interpolation(pair->value);
-    return success;
   }
-  if (value_result == empty) {
-    remove_unclosed_interpolation(pair->value);
-    return empty;
+  pending_.clear();
+  waiters_.clear();
+  mentions_.clear();
+  pending_count_ = 0;
+}
+
+EnvReaderContext::EnvReaderContext() : buffer_(256, '\0') {
+}
+
+EnvReaderContext::~EnvReaderContext() {
+  EnvReader::delete_pairs(&pairs_);
+  EnvReader::delete_pairs(&pool_);
+}
+
+EnvPair* EnvReaderContext::acquire_pair() {
+  EnvPair* pair;
+  if (pool_.empty()) {
+    pair = new EnvPair();
+    pair->key = new EnvKey();
+    pair->value = new EnvValue();
+  } else {
+    pair = pool_.back();
+    pool_.pop_back();
+    pair->key->reset();
+    pair->value->reset();
+  }
+  // Recycled pairs read straight into the buffers they already own.
+  if (!pair->key->has_own_buffer()) {
+    pair->key->key = &buffer_;
+  }
+  if (!pair->value->has_own_buffer()) {
+    pair->value->value = &buffer_;
+  }
+  return pair;
+}
+
+const std::vector<EnvPair*>& EnvReaderContext::read_pairs(EnvStream* file) {
+  pool_.insert(pool_.end(), pairs_.rbegin(), pairs_.rend());
+  pairs_.clear();
+
+  while (true) {
+    buffer_.clear();
+    EnvPair* pair = acquire_pair();
+    const EnvReader::read_result result = EnvReader::read_pair(file, pair);
+    if (result == EnvReader::success ||
+        result == EnvReader::end_of_stream_value) {
+      pairs_.push_back(pair);
+      if (result == EnvReader::end_of_stream_value) {
+        break;
+      }
+      continue;
+    }
+
+    pool_.push_back(pair);
+    if (result == EnvReader::comment_encountered ||
+        result == EnvReader::fail) {
+      continue;
+    }
+    break;
+  }
+  return pairs_;
+}
+
+EnvDocument::EnvDocument(std::string text)
+  : text_(std::move(text)), buffer_(256, '\0') {
+  size_t resume;
+  read_spans(0, 0, 0, 0, &spans_, &resume);
+}
+
+EnvDocument::~EnvDocument() {
+  for (const Span& span : spans_) {
+    if (span.pair != nullptr) {
+      EnvReader::delete_pair(span.pair);
+    }
+  }
+}
+
+void EnvDocument::read_spans(const size_t start,
+                             const size_t resync_from,
+                             const ptrdiff_t delta,
+                             size_t old_index,
+                             std::vector<Span>* out,
+                             size_t* resume) {
+  EnvStream file(&text_, start);
+  *resume = spans_.size();
+  while (true) {
+    const size_t span_start = file.position();
+    buffer_.clear();
+    EnvPair* pair = new EnvPair();
+    pair->key = new EnvKey();
+    pair->key->key = &buffer_;
+    pair->value = new EnvValue();
+    pair->value->value = &buffer_;
+    const EnvReader::read_result result = EnvReader::read_pair(&file, pair);
+    if (result != EnvReader::success &&
+        result != EnvReader::end_of_stream_value) {
+      EnvReader::delete_pair(pair);
+      pair = nullptr;
+    }
+    const size_t span_end = file.position();
+    if (span_end > span_start || pair != nullptr) {
+      out->push_back({span_start, span_end, pair});
+    }
+    // Stops where read_pairs would.
+    if (pair == nullptr && result != EnvReader::comment_encountered &&
+        result != EnvReader::fail) {
+      return;
+    }
+    if (result == EnvReader::end_of_stream_value) {
+      return;
+    }
+
+    if (span_end < resync_from || old_index >= spans_.size()) {
+      continue;
+    }
+    const auto old_end = static_cast<size_t>(
+        static_cast<ptrdiff_t>(span_end) - delta);
+    while (old_index < spans_.size() && spans_[old_index].start < old_end) {
+      old_index++;
+    }
+    if (old_index < spans_.size() && spans_[old_index].start == old_end) {
+      *resume = old_index;
+      return;
+    }
+  }
+}
+
+bool EnvDocument::edit(const size_t offset,
+                       const size_t length,
+                       const std::string_view replacement,
+                       size_t* first,
+                       size_t* count) {
+  if (offset > text_.size() || length > text_.size() - offset) {
+    return false;
+  }
+  text_.replace(offset, length, replacement.data(), replacement.size());
+  const ptrdiff_t delta = static_cast<ptrdiff_t>(replacement.size()) -
+                          static_cast<ptrdiff_t>(length);
+
+  // The span holding the character before the edit may have looked at it.
+  size_t from = 0;
+  if (offset > 0) {
+    const auto after = std::upper_bound(
+        spans_.begin(), spans_.end(), offset - 1,
+        [](const size_t position, const Span& span) {
+          return position < span.start;
+        });
+    if (after != spans_.begin()) {
+      from = after - spans_.begin() - 1;
+    }
+  }
+  const size_t start = from < spans_.size() ? spans_[from].start : 0;
+
+  std::vector<Span> spans;
+  size_t resume;
+  read_spans(start, offset + replacement.size(), delta, from, &spans,
+             &resume);
+  for (size_t i = from; i < resume; i++) {
+    if (spans_[i].pair != nullptr) {
+      EnvReader::delete_pair(spans_[i].pair);
+    }
+  }
+  // Unsigned wrap around makes this a subtraction for negative deltas.
+  const auto shift = static_cast<size_t>(delta);
+  for (size_t i = resume; i < spans_.size(); i++) {
+    spans_[i].start += shift;
+    spans_[i].end += shift;
+  }
+  // Most edits stay within a line and leave the number of spans alone.
+  if (spans.size() == resume - from) {
+    std::copy(spans.begin(), spans.end(), spans_.begin() + from);
+  } else {
+    spans_.erase(spans_.begin() + from, spans_.begin() + resume);
+    spans_.insert(spans_.begin() + from, spans.begin(), spans.end());
+  }
+
+  if (first != nullptr) {
+    *first = from;
+  }
+  if (count != nullptr) {
+    *count = spans.size();
+  }
+  return true;
+}
+
+EnvPrefixIndex::EnvPrefixIndex(
+    const std::map<std::string, std::string>& entries) {
+  entries_.reserve(entries.size());
+  for (const auto& [key, value] : entries) {
+    entries_.emplace_back(key, value);
+  }
+  build();
+}
+
+EnvPrefixIndex::EnvPrefixIndex(const std::vector<EnvPair*>& pairs) {
+  entries_.reserve(pairs.size());
+  for (const EnvPair* pair : pairs) {
+    entries_.emplace_back(*pair->key->key, *pair->value->value);
+  }
+  std::stable_sort(entries_.begin(), entries_.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.first < b.first;
+                   });
+  build();
+}
+
+void EnvPrefixIndex::build() {
+  if (entries_.empty()) {
+    return;
   }
-  if (value_result == end_of_stream_key) {
-    remove_unclosed_interpolation(pair->value);
-    return end_of_stream_key;
+  const auto common_length = [](const std::string_view a,
+                                const std::string_view b) {
+    const size_t length = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < length && a[i] == b[i]) {
+      i++;
+    }
+    return static_cast<uint32_t>(i);
+  };
+  const auto count = static_cast<uint32_t>(entries_.size());
+  nodes_.push_back({0, count,
+                    common_length(entries_.front().first,
+                                  entries_.back().first),
+                    0, 0});
+  // Breadth first, so the children of a node end up next to each other.
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    const Node node = nodes_[i];
+    // Keys that end at this node sort first and have no child.
+    uint32_t begin = node.begin;
+    while (begin < node.end && entries_[begin].first.size() == node.depth) {
+      begin++;
+    }
+    const auto first_child = static_cast<uint32_t>(nodes_.size());
+    while (begin < node.end) {
+      const char next = entries_[begin].first[node.depth];
+      uint32_t end = begin + 1;
+      while (end < node.end && entries_[end].first[node.depth] == next) {
+        end++;
+      }
+      nodes_.push_back({begin, end,
+                        common_length(entries_[begin].first,
+                                      entries_[end - 1].first),
+                        0, 0});
+      begin = end;
+    }
+    nodes_[i].first_child = first_child;
+    nodes_[i].child_count = static_cast<uint32_t>(nodes_.size()) -
+                            first_child;
   }
+}
 
-  remove_unclosed_interpolation(pair->value);
-  return fail;
+EnvPrefixIndex::View EnvPrefixIndex::all() const {
+  return View(this, nodes_.empty() ? View::kNone : 0, 0, 0);
 }
 
+size_t EnvPrefixIndex::View::size() const {
+  if (node_ == kNone) {
+    return 0;
+  }
+  const Node& node = index_->nodes_[node_];
+  return node.end - node.begin;
+}
 
-int EnvReader::read_pairs(EnvStream* file, std::vector<EnvPair*>* pairs) {
-  int count = 0;
-  auto buffer = std::string(256, '\0');
+std::pair<std::string_view, std::string_view>
+EnvPrefixIndex::View::operator[](const size_t i) const {
+  const auto& entry = index_->entries_[index_->nodes_[node_].begin + i];
+  return {entry.first.substr(stripped_), entry.second};
+}
+
+EnvPrefixIndex::View EnvPrefixIndex::View::find(
+    const std::string_view prefix) const {
+  return descend(prefix, false);
+}
 
+EnvPrefixIndex::View EnvPrefixIndex::View::strip(
+    const std::string_view prefix) const {
+  return descend(prefix, true);
+}
+
+EnvPrefixIndex::View EnvPrefixIndex::View::descend(
+    const std::string_view prefix,
+    const bool strip) const {
+  const View none(index_, kNone, 0, 0);
+  if (node_ == kNone) {
+    return none;
+  }
+  const std::vector<Node>& nodes = index_->nodes_;
+  const auto& entries = index_->entries_;
+  const size_t target = matched_ + prefix.size();
+  size_t position = matched_;
+  uint32_t current = node_;
   while (true) {
-    buffer.clear();
-    EnvPair* pair = new EnvPair();
-    pair->key = new EnvKey();
-    pair->key->key = &buffer;
-    pair->value = new EnvValue();
-    pair->value->value = &buffer;
-    const read_result result = read_pair(file, pair);
-    if (result == end_of_stream_value) {
-      pairs->push_back(pair);
-      count++;
-      break;
+    const Node& node = nodes[current];
+    // Every key under node shares its first depth characters, so one key
+    // stands for all of them.
+    const std::string_view key = entries[node.begin].first;
+    const size_t limit = std::min<size_t>(node.depth, target);
+    if (key.compare(position, limit - position, prefix,
+                    position - matched_, limit - position) != 0) {
+      return none;
     }
-    if (result == success) {
-      pairs->push_back(pair);
-      count++;
-      continue;
+    position = limit;
+    if (position == target) {
+      const auto matched = static_cast<uint32_t>(target);
+      return View(index_, current, matched, strip ? matched : stripped_);
+    }
+    // Keys sort as unsigned bytes, so children are searched that way too.
+    const auto byte = [&entries, &node](const Node& child) {
+      return static_cast<unsigned char>(entries[child.begin].first[node.depth]);
+    };
+    const auto next = static_cast<unsigned char>(prefix[position - matched_]);
+    const Node* first = nodes.data() + node.first_child;
+    const Node* last = first + node.child_count;
+    const Node* child = std::lower_bound(
+        first, last, next, [&byte](const Node& a, const unsigned char c) {
+          return byte(a) < c;
+        });
+    if (child == last || byte(*child) != next) {
+      return none;
     }
+    current = static_cast<uint32_t>(child - nodes.data());
+  }
+}
 
-    delete pair->key;
-    delete pair->value;
-    delete pair;
-    if (result == comment_encountered || result == fail) {
+void EnvPairTable::append(const EnvPair* pair) {
+  const std::string_view key(pair->key->key->data(), pair->key->key_index);
+  const std::string_view value(pair->value->value->data(),
+                               pair->value->value_index);
+
+  key_offsets.push_back(static_cast<uint32_t>(buffer.size()));
+  key_lengths.push_back(static_cast<uint32_t>(key.size()));
+  buffer.append(key);
+  value_offsets.push_back(static_cast<uint32_t>(buffer.size()));
+  value_lengths.push_back(static_cast<uint32_t>(value.size()));
+  buffer.append(value);
+
+  const EnvValue* env_value = pair->value;
+  flags.push_back(static_cast<uint8_t>(
+      (env_value->quoted ? quoted : 0) |
+      (env_value->triple_quoted ? triple_quoted : 0) |
+      (env_value->double_quoted ? double_quoted : 0) |
+      (env_value->triple_double_quoted ? triple_double_quoted : 0) |
+      (env_value->implicit_double_quote ? implicit_double_quote : 0) |
+      (env_value->back_tick_quoted ? back_tick_quoted : 0)));
+
+  for (const VariablePosition& interpolation : env_value->interpolations) {
+    if (!interpolation.closed) {
       continue;
     }
-    break;
+    dollar_signs.push_back(interpolation.dollar_sign);
+    end_braces.push_back(interpolation.end_brace);
+    variable_starts.push_back(interpolation.variable_start);
+    // ${ } has its end before its start once whitespace is trimmed.
+    variable_lengths.push_back(std::max(
+        0, interpolation.variable_end - interpolation.variable_start + 1));
   }
+  interpolation_offsets.push_back(static_cast<uint32_t>(dollar_signs.size()));
+}
 
-  return count;
+void EnvPairTable::clear() {
+  buffer.clear();
+  key_offsets.clear();
+  key_lengths.clear();
+  value_offsets.clear();
+  value_lengths.clear();
+  flags.clear();
+  interpolation_offsets.assign(1, 0);
+  dollar_signs.clear();
+  end_braces.clear();
+  variable_starts.clear();
+  variable_lengths.clear();
 }
 
 void EnvReader::delete_pair(const EnvPair* pair) {
@@ -368,6 +2800,10 @@ EnvReader::read_result EnvReader::position_of_dollar_last_sign(
     }
     return fail;
   }
+  // A '{' with nothing but spaces in front of it isn't a variable.
+  if (tmp < 0) {
+    return fail;
+  }
   *position = tmp;
   return success;
 }
@@ -504,8 +2940,8 @@ void EnvReader::walk_back_slashes(EnvValue* value) {
 
 void EnvReader::close_variable(EnvValue* value) {
   value->is_parsing_variable = false;
-  VariablePosition* const interpolation = value->interpolations->at(
-      value->interpolation_index);
+  VariablePosition* const interpolation = &value->interpolations[
+      value->interpolation_index];
   interpolation->end_brace = value->value_index - 1;
   interpolation->variable_end = value->value_index - 2;
   if (const auto left_whitespace = get_white_space_offset_left(
@@ -520,26 +2956,57 @@ void EnvReader::close_variable(EnvValue* value) {
     interpolation->variable_end =
         interpolation->variable_end - right_whitespace;
   }
-  const auto variable_len = (interpolation->variable_end - interpolation->
-                             variable_start) + 1;
-  interpolation->variable_str->resize(variable_len);
-  interpolation->variable_str->replace(0,
-                                       variable_len,
-                                       *value->value,
-                                       interpolation->variable_start,
-                                       variable_len);
+  // Split off a -default or :-default; the name is what comes before it.
+  const std::string& text = *value->value;
+  for (int i = interpolation->variable_start;
+       i <= interpolation->variable_end; i++) {
+    if (text[i] != '-') {
+      continue;
+    }
+    interpolation->default_start = i + 1;
+    interpolation->default_end = interpolation->variable_end + 1;
+    int name_end = i - 1;
+    if (name_end >= interpolation->variable_start && text[name_end] == ':') {
+      interpolation->default_if_empty = true;
+      name_end--;
+    }
+    while (name_end >= interpolation->variable_start &&
+           text[name_end] == ' ') {
+      name_end--;
+    }
+    // Only a plain identifier takes a default, so ${a.b-c} stays one name.
+    bool identifier = name_end >= interpolation->variable_start &&
+                      !std::isdigit(static_cast<unsigned char>(
+                          text[interpolation->variable_start]));
+    for (int j = interpolation->variable_start;
+         identifier && j <= name_end; j++) {
+      identifier = std::isalnum(static_cast<unsigned char>(text[j])) ||
+                   text[j] == '_';
+    }
+    if (!identifier) {
+      interpolation->default_start = -1;
+      interpolation->default_end = -1;
+      interpolation->default_if_empty = false;
+      break;
+    }
+    interpolation->variable_end = name_end;
+    break;
+  }
   interpolation->closed = true;
   value->interpolation_index++;
 }
 
 void EnvReader::open_variable(EnvValue* value) {
+  if (value->sunk > 0) {
+    return;
+  }
   int position;
   const auto result = position_of_dollar_last_sign(value, &position);
 
   if (result == success) {
     value->is_parsing_variable = true;
-    value->interpolations->push_back(
-        new VariablePosition(value->value_index,
+    value->interpolations.push_back(
+        VariablePosition(value->value_index,
                              value->value_index - 1,
                              position));
   }
@@ -688,19 +3155,151 @@ bool EnvReader::walk_single_quotes(EnvValue* value) {
 
 
 void EnvReader::add_to_buffer(EnvValue* value, const char key_char) {
-  size_t size = value->value->size();
-  if (static_cast<size_t>(value->value_index) >= size) {
-    if (size == 0) {
-      size = 100;
-    }
-    value->value->resize(size * 150 / 100);
+  if (static_cast<size_t>(value->value_index) >= value->value->size()) {
+    grow_buffer(value, 1);
   }
   (*value->value)[value->value_index] = key_char;
   value->value_index++;
 }
 
+void EnvReader::grow_buffer(EnvValue* value, const size_t count) {
+  size_t size = value->value->size();
+  if (value->value_index + count <= size) {
+    return;
+  }
+  // A value that has outgrown its sink's threshold makes room by handing
+  // what it has so far to the sink instead.
+  if (value->sink != nullptr &&
+      static_cast<size_t>(value->value_index) >= value->sink->threshold()) {
+    sink_buffer(value);
+  }
+  const size_t needed = value->value_index + count;
+  if (needed <= size) {
+    return;
+  }
+  if (size == 0) {
+    size = 100;
+  }
+  do {
+    size = size * 150 / 100;
+  } while (size < needed);
+  value->value->resize(size);
+}
+
+void EnvReader::add_run_to_buffer(EnvValue* value,
+                                  const char* data,
+                                  const size_t length) {
+  grow_buffer(value, length);
+  memcpy(value->value->data() + value->value_index, data, length);
+  value->value_index += static_cast<int>(length);
+}
+
+namespace {
+// What sink_buffer keeps of a value: the reader still looks back at the
+// character before a newline (for a '\r') and must not see index 0 again.
+constexpr size_t kSinkTail = 16;
+}  // namespace
+
+void EnvReader::sink_buffer(EnvValue* value) {
+  const size_t length = value->value_index;
+  size_t keep = std::min(kSinkTail, length);
+  // Trailing spaces of an implicitly quoted value may still be trimmed.
+  if (value->implicit_double_quote) {
+    while (keep < length && (*value->value)[length - keep - 1] == ' ') {
+      keep++;
+    }
+  }
+  const size_t flushed = length - keep;
+  if (flushed == 0) {
+    return;
+  }
+  if (value->sunk == 0) {
+    // Interpolation positions point into the buffer, which is about to be
+    // reused, so a sunk value is taken literally.
+    value->interpolations.clear();
+    value->is_parsing_variable = false;
+    value->sink->begin(*value->sink_key);
+  }
+  char* data = value->value->data();
+  value->sink->write(data, flushed);
+  memmove(data, data + flushed, keep);
+  value->value_index = static_cast<int>(keep);
+  value->sunk += flushed;
+}
+
+// Hands the rest of a value that went to the sink over once it has been
+// read, or all of it if it only reached the threshold at the end.
+void EnvReader::finish_sink(EnvValue* value) {
+  const size_t length = value->value_index;
+  if (value->sunk == 0) {
+    if (length == 0 || length < value->sink->threshold()) {
+      return;
+    }
+    value->interpolations.clear();
+    value->is_parsing_variable = false;
+    value->sink->begin(*value->sink_key);
+  }
+  value->sink->write(value->value->data(), length);
+  value->sink->end();
+  value->sunk += length;
+  value->value_index = 0;
+}
+
+bool EnvReader::can_read_escaped_run(const EnvValue* value) {
+  return value->value_index > 0 &&
+         (value->double_quoted || value->triple_double_quoted) &&
+         !value->quoted && !value->triple_quoted &&
+         value->back_slash_streak == 0 && value->single_quote_streak == 0 &&
+         value->double_quote_streak == 0;
+}
+
+/**
+ * \brief Bulk path through the middle of a double quoted, implicitly quoted
+ * or triple double quoted value. Plain runs are block copied and backslash
+ * runs are halved in one go. It stops in front of anything else that
+ * read_next_char has to see: quotes, comments, braces, newlines, high-bit
+ * bytes, or the character after an odd backslash, which is left pending in
+ * back_slash_streak exactly as read_next_char would have.
+ * \param last_char set to the last character consumed, if any
+ */
+void EnvReader::read_escaped_run(EnvStream* file,
+                                 EnvValue* value,
+                                 char* last_char) {
+  while (file->good()) {
+    const char* data = file->cursor();
+    const size_t remaining = file->remaining();
+    const size_t run = find_special<'\\', '"', '\'', '`', '#', '{', '}',
+                                    '\n'>(data, remaining);
+    if (run > 0) {
+      add_run_to_buffer(value, data, run);
+      file->skip(run);
+      *last_char = data[run - 1];
+    }
+    if (run == remaining || data[run] != '\\') {
+      return;
+    }
+
+    size_t backslashes = run + 1;
+    while (backslashes < remaining && data[backslashes] == '\\') {
+      backslashes++;
+    }
+    backslashes -= run;
+    file->skip(backslashes);
+    *last_char = '\\';
+    grow_buffer(value, backslashes / 2);
+    memset(value->value->data() + value->value_index, '\\', backslashes / 2);
+    value->value_index += static_cast<int>(backslashes / 2);
+    if (backslashes % 2 == 1) {
+      value->back_slash_streak = 1;
+      return;
+    }
+  }
+}
+
+template <typename Dialect>
 bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
-  if (!value->quoted && !value->triple_quoted && value->back_slash_streak > 0) {
+  if (Dialect::escapes && !value->quoted && !value->triple_quoted &&
+      value->back_slash_streak > 0) {
     if (key_char != '\\') {
       walk_back_slashes(value);
       if (value->back_slash_streak == 1) {
@@ -713,16 +3312,16 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
       }
     }
   }
-  if (!value->triple_double_quoted && !value->double_quoted && value->
-      single_quote_streak > 0) {
+  if (Dialect::quotes && !value->triple_double_quoted &&
+      !value->double_quoted && value->single_quote_streak > 0) {
     if (key_char != '\'') {
       if (walk_single_quotes(value)) {
         return false;
       }
     }
   }
-  if (!value->triple_quoted && !value->quoted && value->
-      double_quote_streak > 0) {
+  if (Dialect::quotes && !value->triple_quoted && !value->quoted &&
+      value->double_quote_streak > 0) {
     if (key_char != '"') {
       if (walk_double_quotes(value)) {
         return false;
@@ -732,7 +3331,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
   // Check to see if the first character is a ' or ". If it is neither,
   // it is an implicit double quote.
   if (value->value_index == 0) {
-    if (key_char == '`') {
+    if (Dialect::back_ticks && key_char == '`') {
       if (value->back_tick_quoted) {
         return false;
       }
@@ -749,7 +3348,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
           !value->triple_double_quoted) {
         return false;
       }
-    } else if (!(key_char == '"' || key_char == '\'')) {
+    } else if (!Dialect::quotes || !(key_char == '"' || key_char == '\'')) {
       if (!value->quoted && !value->triple_quoted && !value->double_quoted
           && !value->triple_double_quoted) {
         value->double_quoted = true;
@@ -762,7 +3361,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
   }
   switch (key_char) {
     case '`':
-      if (value->back_tick_quoted) {
+      if (Dialect::back_ticks && value->back_tick_quoted) {
         return false;
       }
       add_to_buffer(value, key_char);
@@ -786,8 +3385,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
       add_to_buffer(value, key_char);
       return true;
     case '\\':
-
-      if (value->quoted || value->triple_quoted) {
+      if (!Dialect::escapes || value->quoted || value->triple_quoted) {
         add_to_buffer(value, key_char);
         return true;
       }
@@ -796,7 +3394,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
       return true;
     case '{':
       add_to_buffer(value, key_char);
-      if (!value->quoted && !value->triple_quoted) {
+      if (Dialect::interpolation && !value->quoted && !value->triple_quoted) {
         if (!value->is_parsing_variable) {
           // check to see if it's an escaped '{'
           if (!is_previous_char_an_escape(value)) {
@@ -807,7 +3405,7 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
       return true;
     case '}':
       add_to_buffer(value, key_char);
-      if (value->is_parsing_variable) {
+      if (Dialect::interpolation && value->is_parsing_variable) {
         // check to see if it's an escaped '}'
         if (!is_previous_char_an_escape(value)) {
           close_variable(value);
@@ -816,7 +3414,14 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
 
       return true;
     case '\'':
-      if (!value->double_quoted && !value->triple_double_quoted) {
+      if (Dialect::quotes && !value->double_quoted &&
+          !value->triple_double_quoted) {
+        // Without heredocs a third quote at the start is the first thing
+        // after an empty '' value.
+        if (!Dialect::heredocs && value->value_index == 0 &&
+            value->single_quote_streak == 2) {
+          return !walk_single_quotes(value);
+        }
         value->single_quote_streak++;
       } else {
         add_to_buffer(value, key_char);
@@ -824,8 +3429,12 @@ bool EnvReader::read_next_char(EnvValue* value, const char key_char) {
       return true;
 
     case '"':
-      if (!value->quoted && !value->triple_quoted && !value->back_tick_quoted &&
-          !value->implicit_double_quote) {
+      if (Dialect::quotes && !value->quoted && !value->triple_quoted &&
+          !value->back_tick_quoted && !value->implicit_double_quote) {
+        if (!Dialect::heredocs && value->value_index == 0 &&
+            value->double_quote_streak == 2) {
+          return !walk_double_quotes(value);
+        }
         value->double_quote_streak++;
       } else {
         add_to_buffer(value, key_char);
@@ -848,6 +3457,7 @@ bool EnvReader::is_previous_char_an_escape(const EnvValue* value) {
 }
 
 
+template <typename Dialect>
 EnvReader::read_result EnvReader::read_value(EnvStream* file,
                                              EnvValue* value) {
   if (!file->good()) {
@@ -856,12 +3466,18 @@ EnvReader::read_result EnvReader::read_value(EnvStream* file,
 
   char key_char = 0;
   while (file->good()) {
+    if (Dialect::escapes && can_read_escaped_run(value)) {
+      read_escaped_run(file, value, &key_char);
+      if (!file->good()) {
+        break;
+      }
+    }
     key_char = file->get();
     if (key_char < 0) {
       break;
     }
 
-    if (read_next_char(value, key_char) && file->good()) {
+    if (read_next_char<Dialect>(value, key_char) && file->good()) {
       continue;
     }
     break;
@@ -903,39 +3519,270 @@ EnvReader::read_result EnvReader::read_value(EnvStream* file,
 }
 
 void EnvReader::remove_unclosed_interpolation(EnvValue* value) {
-  for (int i = value->interpolation_index - 1; i >= 0; i--) {
-    const VariablePosition* interpolation = value->interpolations->at(i);
-    if (interpolation->closed) {
-      continue;
+  // Only the last interpolation can still be open.
+  while (!value->interpolations.empty() &&
+         !value->interpolations.back().closed) {
+    value->interpolations.pop_back();
+  }
+}
+
+EnvWriter::quote_style EnvWriter::pick_style(const std::string_view value,
+                                             const bool keep_interpolations) {
+  // The reader hands out bytes with the high bit set as negative chars,
+  // which end the read in every quoting style.
+  if (find_special<>(value.data(), value.size()) != value.size()) {
+    return unrepresentable;
+  }
+  const bool interpolates = has_interpolation_syntax(value);
+  if (interpolates && !keep_interpolations) {
+    // Only the literal styles can carry ${...} through as text.
+    const bool has_newline = value.find('\n') != std::string_view::npos;
+    if (value.find('\'') == std::string_view::npos && !has_newline) {
+      return single_quoted;
+    }
+    if (value.find("'''") == std::string_view::npos &&
+        value.front() != '\'' && value.back() != '\'') {
+      return triple_single_quoted;
+    }
+    return unrepresentable;
+  }
+
+  if (value.empty() ||
+      (value.front() != '"' && value.front() != '\'' &&
+       value.front() != '`' && value.front() != ' ' && value.back() != ' ' &&
+       value.back() != '\r' &&
+       find_special<'\\', '#', '\n'>(value.data(), value.size()) ==
+           value.size() &&
+       (keep_interpolations || value.find('{') == std::string_view::npos))) {
+    return bare;
+  }
+
+  size_t escapes = 0;
+  for (const char c : value) {
+    escapes += escape_code(c) != 0 ? 1 : 0;
+  }
+  if (keep_interpolations) {
+    return double_quoted;
+  }
+  // '...' costs the same as an escape-free "...", so prefer it. A heredoc
+  // only pays off over "..." once it saves more than four escapes.
+  if (value.find('\'') == std::string_view::npos &&
+      value.find('\n') == std::string_view::npos) {
+    return single_quoted;
+  }
+  if (escapes > 4 && value.find("'''") == std::string_view::npos &&
+      value.front() != '\'' && value.back() != '\'') {
+    return triple_single_quoted;
+  }
+  return double_quoted;
+}
+
+EnvWriter::write_result EnvWriter::measure(const std::vector<EnvPair*>* pairs,
+                                           std::vector<quote_style>* styles,
+                                           size_t* size) {
+  size_t total = 0;
+  styles->clear();
+  styles->reserve(pairs->size());
+  for (const EnvPair* pair : *pairs) {
+    const std::string_view key(*pair->key->key);
+    const std::string_view value(*pair->value->value);
+    if (!is_writable_key(key)) {
+      return invalid_key;
+    }
+    const bool keep_interpolations = !pair->value->is_already_interpolated &&
+                                     !pair->value->interpolations.empty();
+    const quote_style style = pick_style(value, keep_interpolations);
+    // key=value\n
+    total += key.size() + value.size() + 2;
+    switch (style) {
+      case bare:
+        break;
+      case single_quoted:
+        total += 2;
+        break;
+      case triple_single_quoted:
+        total += 6;
+        break;
+      case double_quoted:
+        total += 2;
+        for (const char c : value) {
+          total += escape_code(c) != 0 ? 1 : 0;
+        }
+        break;
+      case unrepresentable:
+        return invalid_value;
+    }
+    styles->push_back(style);
+  }
+  *size = total;
+  return success;
+}
+
+char* EnvWriter::write_pair(char* out,
+                            const EnvPair* pair,
+                            const quote_style style) {
+  const std::string& key = *pair->key->key;
+  const std::string& value = *pair->value->value;
+  memcpy(out, key.data(), key.size());
+  out += key.size();
+  *out++ = '=';
+  switch (style) {
+    case single_quoted:
+      *out++ = '\'';
+      memcpy(out, value.data(), value.size());
+      out += value.size();
+      *out++ = '\'';
+      break;
+    case triple_single_quoted:
+      memcpy(out, "'''", 3);
+      out += 3;
+      memcpy(out, value.data(), value.size());
+      out += value.size();
+      memcpy(out, "'''", 3);
+      out += 3;
+      break;
+    case double_quoted:
+      *out++ = '"';
+      for (const char c : value) {
+        if (const char code = escape_code(c); code != 0) {
+          *out++ = '\\';
+          *out++ = code;
+        } else {
+          *out++ = c;
+        }
+      }
+      *out++ = '"';
+      break;
+    default:
+      memcpy(out, value.data(), value.size());
+      out += value.size();
+  }
+  *out++ = '\n';
+  return out;
+}
+
+EnvWriter::write_result EnvWriter::serialized_size(
+    const std::vector<EnvPair*>* pairs,
+    size_t* size) {
+  std::vector<quote_style> styles;
+  return measure(pairs, &styles, size);
+}
+
+EnvWriter::write_result EnvWriter::write_pairs(
+    const std::vector<EnvPair*>* pairs,
+    char* buffer,
+    const size_t size,
+    size_t* written) {
+  std::vector<quote_style> styles;
+  size_t needed;
+  if (const write_result result = measure(pairs, &styles, &needed);
+      result != success) {
+    return result;
+  }
+  if (needed > size) {
+    *written = needed;
+    return buffer_too_small;
+  }
+  char* out = buffer;
+  for (size_t i = 0; i < pairs->size(); i++) {
+    out = write_pair(out, pairs->at(i), styles[i]);
+  }
+  *written = out - buffer;
+  return success;
+}
+
+EnvWriter::write_result EnvWriter::write_pairs(
+    const std::vector<EnvPair*>* pairs,
+    const int fd) {
+  size_t size;
+  if (const write_result result = serialized_size(pairs, &size);
+      result != success) {
+    return result;
+  }
+  std::string text(size, '\0');
+  size_t written;
+  if (const write_result result =
+          write_pairs(pairs, text.data(), text.size(), &written);
+      result != success) {
+    return result;
+  }
+
+  size_t offset = 0;
+  while (offset < written) {
+    uv_fs_t req;
+    uv_buf_t buf = uv_buf_init(text.data() + offset,
+                               static_cast<unsigned int>(written - offset));
+    const auto r = uv_fs_write(nullptr, &req, fd, &buf, 1, -1, nullptr);
+    uv_fs_req_cleanup(&req);
+    if (r <= 0) {
+      return io_error;
     }
-    value->interpolations->erase(
-        value->interpolations->begin() + value->interpolation_index);
-    delete interpolation;
-    value->interpolation_index--;
+    offset += r;
   }
+  return success;
 }
 
 EnvReader::finalize_result EnvReader::finalize_value(
     const EnvPair* pair,
     std::vector<EnvPair*>* pairs) {
+  return finalize_value(pair, pairs, nullptr);
+}
+
+EnvReader::finalize_result EnvReader::finalize_value(
+    const EnvPair* pair,
+    std::vector<EnvPair*>* pairs,
+    const EnvironmentSnapshot* environment) {
+  // How many finalize_value calls deep this one is, following references.
+  thread_local int depth = 0;
+  CPPNV_PROBE2(finalize_value__start, pair->key->key->c_str(), depth);
+  TraceSpan span("finalize_value");
+  span.set_detail("depth", depth);
+  depth++;
+  const finalize_result result =
+      finalize_value_step(pair, pairs, environment);
+  depth--;
+  CPPNV_PROBE3(finalize_value__done, pair->key->key->c_str(), depth,
+               static_cast<int>(result));
+  return result;
+}
+
+EnvReader::finalize_result EnvReader::finalize_value_step(
+    const EnvPair* pair,
+    std::vector<EnvPair*>* pairs,
+    const EnvironmentSnapshot* environment) {
   if (pair->value->interpolation_index == 0) {
     pair->value->is_already_interpolated = true;
     pair->value->is_being_interpolated = false;
     return copied;
   }
+  // The positions only match the value as it was read.
+  if (pair->value->is_already_interpolated) {
+    return interpolated;
+  }
+  const auto is_key = [pairs](const std::string_view name) {
+    for (size_t j = 0; pairs != nullptr && j < pairs->size(); j++) {
+      if (*pairs->at(j)->key->key == name) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (VariablePosition& interpolation : pair->value->interpolations) {
+    settle_default(&interpolation, *pair->value->value, environment, is_key);
+  }
   pair->value->is_being_interpolated = true;
+  // Replace into a copy so a circular reference leaves the value as it was.
   const auto buffer = new std::string(*pair->value->value);
 
-  pair->value->set_own_buffer(buffer);
-
-  const auto size = static_cast<int>(pair->value->interpolations->size());
+  const auto size = static_cast<int>(pair->value->interpolations.size());
   for (auto i = size - 1; i >= 0; i--) {
-    const VariablePosition* interpolation = pair->value->interpolations->at(i);
+    const VariablePosition* interpolation = &pair->value->interpolations[i];
+    const size_t variable_str_len = std::max(
+        0, interpolation->variable_end - interpolation->variable_start + 1);
 
-    for (const EnvPair* other_pair : *pairs) {
-      const size_t variable_str_len =
-          static_cast<size_t>(interpolation->variable_end) - interpolation->
-          variable_start + 1;
+    const EnvPair* match = nullptr;
+    for (size_t j = 0; pairs != nullptr && j < pairs->size(); j++) {
+      const EnvPair* other_pair = pairs->at(j);
       if (variable_str_len != other_pair->key->
                                           key->size()) {
         continue;
@@ -946,26 +3793,305 @@ EnvReader::finalize_result EnvReader::finalize_value(
                       variable_start,
                       variable_str_len))
         continue;
-      if (other_pair->value->is_being_interpolated) {
+      match = other_pair;
+      break;
+    }
+    if (match != nullptr) {
+      if (match->value->is_being_interpolated) {
+        delete buffer;
+        pair->value->is_being_interpolated = false;
         return circular;
       }
-      if (!other_pair->value->is_already_interpolated) {
-        const auto walk_result = finalize_value(other_pair, pairs);
+      if (!match->value->is_already_interpolated) {
+        const auto walk_result = finalize_value(match, pairs, environment);
         if (walk_result == circular) {
+          delete buffer;
+          pair->value->is_being_interpolated = false;
           return circular;
         }
       }
+    }
+    std::string replacement;
+    if (pick_replacement(*interpolation, *pair->value->value,
+                         match == nullptr ? nullptr : match->value->value,
+                         environment, &replacement)) {
       buffer->replace(interpolation->dollar_sign,
                       (interpolation->end_brace
                        - interpolation->dollar_sign) +
                       1,
-                      *other_pair->value->value);
-
-      break;
+                      replacement);
     }
   }
+  pair->value->set_own_buffer(buffer);
   pair->value->is_already_interpolated = true;
   pair->value->is_being_interpolated = false;
   return interpolated;
 }
+
+EnvReader::finalize_result EnvReader::finalize_pairs(
+    std::vector<EnvPair*>* pairs,
+    std::vector<std::vector<EnvPair*>>* cycles,
+    const EnvironmentSnapshot* environment) {
+  constexpr size_t kNone = static_cast<size_t>(-1);
+  const size_t count = pairs->size();
+  CPPNV_PROBE1(finalize_pairs__start, count);
+  TraceSpan span("finalize_pairs");
+  span.set_detail("pairs", count);
+
+  // References resolve to the first pair with a matching key, like
+  // finalize_value.
+  std::unordered_map<std::string_view, size_t> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    keys.emplace(*pairs->at(i)->key->key, i);
+  }
+
+  // Interpolation j of pair i points at targets[edges[i] + j]. Pairs that
+  // are already finalized no longer match their positions and are leaves.
+  std::vector<size_t> edges(count + 1, 0);
+  std::vector<size_t> targets;
+  const auto is_key = [&keys](const std::string_view name) {
+    return keys.count(name) != 0;
+  };
+  for (size_t i = 0; i < count; i++) {
+    EnvValue* value = pairs->at(i)->value;
+    edges[i] = targets.size();
+    if (value->is_already_interpolated) {
+      continue;
+    }
+    for (VariablePosition& interpolation : value->interpolations) {
+      settle_default(&interpolation, *value->value, environment, is_key);
+      const int length =
+          interpolation.variable_end - interpolation.variable_start + 1;
+      const auto match = keys.find(std::string_view(*value->value).substr(
+          interpolation.variable_start, std::max(0, length)));
+      targets.push_back(match == keys.end() ? kNone : match->second);
+    }
+  }
+  edges[count] = targets.size();
+
+  // Tarjan's algorithm, iteratively so deep reference chains can't overflow
+  // the stack. Components come out dependencies first, so every pair is
+  // finalized after everything it references.
+  std::vector<size_t> order(count, kNone);
+  std::vector<size_t> low_link(count, 0);
+  std::vector<bool> on_stack(count, false);
+  std::vector<bool> cyclic(count, false);
+  std::vector<size_t> component;
+  std::vector<std::pair<size_t, size_t>> calls;
+  size_t next_order = 0;
+  finalize_result result = interpolated;
+
+  for (size_t root = 0; root < count; root++) {
+    if (order[root] != kNone) {
+      continue;
+    }
+    calls.emplace_back(root, edges[root]);
+    while (!calls.empty()) {
+      auto& [node, edge] = calls.back();
+      if (edge == edges[node]) {
+        order[node] = low_link[node] = next_order++;
+        component.push_back(node);
+        on_stack[node] = true;
+      }
+      if (edge < edges[node + 1]) {
+        const size_t target = targets[edge++];
+        if (target == kNone) {
+          continue;
+        }
+        if (order[target] == kNone) {
+          calls.emplace_back(target, edges[target]);
+        } else if (on_stack[target]) {
+          low_link[node] = std::min(low_link[node], order[target]);
+        }
+        continue;
+      }
+
+      const size_t finished = node;
+      calls.pop_back();
+      if (!calls.empty()) {
+        const size_t parent = calls.back().first;
+        low_link[parent] = std::min(low_link[parent], low_link[finished]);
+      }
+      if (low_link[finished] != order[finished]) {
+        continue;
+      }
+
+      // The component is the top of the stack down to finished. Searching
+      // from the top keeps long acyclic chains linear.
+      auto start = component.end();
+      while (*--start != finished) {
+      }
+      bool is_cycle = component.end() - start > 1;
+      for (size_t edge_index = edges[finished];
+           !is_cycle && edge_index < edges[finished + 1]; edge_index++) {
+        is_cycle = targets[edge_index] == finished;
+      }
+      if (is_cycle) {
+        result = circular;
+        std::vector<EnvPair*> cycle;
+        for (auto it = start; it != component.end(); ++it) {
+          cyclic[*it] = true;
+          on_stack[*it] = false;
+          cycle.push_back(pairs->at(*it));
+        }
+        if (cycles != nullptr) {
+          cycles->push_back(std::move(cycle));
+        }
+      } else {
+        on_stack[finished] = false;
+        finalize_resolved(pairs->at(finished),
+                          pairs,
+                          targets.data() + edges[finished],
+                          cyclic,
+                          environment);
+      }
+      component.erase(start, component.end());
+    }
+  }
+  CPPNV_PROBE2(finalize_pairs__done, count, static_cast<int>(result));
+  return result;
+}
+
+// Substitutes every reference whose target is finalized, last one first so
+// the earlier positions stay valid. References to pairs in a cycle are left
+// as written, references to nothing fall back to the environment and then
+// the default.
+void EnvReader::finalize_resolved(const EnvPair* pair,
+                                  const std::vector<EnvPair*>* pairs,
+                                  const size_t* targets,
+                                  const std::vector<bool>& cyclic,
+                                  const EnvironmentSnapshot* environment) {
+  EnvValue* value = pair->value;
+  if (value->is_already_interpolated) {
+    return;
+  }
+  for (size_t i = value->interpolations.size(); i-- > 0;) {
+    const size_t target = targets[i];
+    const bool found = target != static_cast<size_t>(-1);
+    if (found && cyclic[target]) {
+      continue;
+    }
+    const VariablePosition& interpolation = value->interpolations[i];
+    std::string replacement;
+    if (pick_replacement(interpolation, *value->value,
+                         found ? pairs->at(target)->value->value : nullptr,
+                         environment, &replacement)) {
+      value->value->replace(interpolation.dollar_sign,
+                            interpolation.end_brace -
+                            interpolation.dollar_sign + 1,
+                            replacement);
+    }
+  }
+  value->is_already_interpolated = true;
+  value->is_being_interpolated = false;
+}
+namespace {
+struct TraceEvent {
+  const char* name;
+  uint64_t start;
+  uint64_t duration;
+  const char* detail_name;
+  uint64_t detail;
+  size_t thread;
+};
+
+std::atomic<bool> trace_recording{false};
+std::mutex trace_mutex;
+std::vector<TraceEvent>* trace_events = new std::vector<TraceEvent>();
+}  // namespace
+
+void TraceEventWriter::Start() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events->clear();
+  trace_recording.store(true, std::memory_order_relaxed);
+}
+
+bool TraceEventWriter::IsRecording() {
+  return trace_recording.load(std::memory_order_relaxed);
+}
+
+void TraceEventWriter::Record(const char* name,
+                              const uint64_t start,
+                              const uint64_t duration,
+                              const char* detail_name,
+                              const uint64_t detail) {
+  const size_t thread =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xffffff;
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events->push_back({name, start, duration, detail_name, detail, thread});
+}
+
+bool TraceEventWriter::Stop(const std::string& path) {
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_recording.store(false, std::memory_order_relaxed);
+    events.swap(*trace_events);
+  }
+
+  const std::string pid = std::to_string(uv_os_getpid());
+  std::string json = "{\"traceEvents\":[";
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent& event = events[i];
+    json += i == 0 ? "\n" : ",\n";
+    json += "{\"name\":\"";
+    json += event.name;
+    json += "\",\"cat\":\"cppnv\",\"ph\":\"X\",\"pid\":";
+    json += pid;
+    json += ",\"tid\":";
+    json += std::to_string(event.thread);
+    json += ",\"ts\":";
+    json += std::to_string(event.start);
+    json += ",\"dur\":";
+    json += std::to_string(event.duration);
+    if (event.detail_name != nullptr) {
+      json += ",\"args\":{\"";
+      json += event.detail_name;
+      json += "\":";
+      json += std::to_string(event.detail);
+      json += "}";
+    }
+    json += "}";
+  }
+  json += "\n]}\n";
+
+  uv_fs_t req;
+  const uv_file file = uv_fs_open(nullptr, &req, path.c_str(),
+                                  UV_FS_O_WRONLY | UV_FS_O_CREAT |
+                                  UV_FS_O_TRUNC, 0644, nullptr);
+  uv_fs_req_cleanup(&req);
+  if (file < 0) {
+    return false;
+  }
+  bool written = true;
+  size_t offset = 0;
+  while (offset < json.size()) {
+    uv_buf_t buf = uv_buf_init(json.data() + offset,
+                               static_cast<unsigned int>(json.size() - offset));
+    const auto r = uv_fs_write(nullptr, &req, file, &buf, 1, -1, nullptr);
+    uv_fs_req_cleanup(&req);
+    if (r <= 0) {
+      written = false;
+      break;
+    }
+    offset += r;
+  }
+  uv_fs_close(nullptr, &req, file, nullptr);
+  uv_fs_req_cleanup(&req);
+  return written;
+}
+
+template EnvReader::read_result EnvReader::read_pair<FullDialect>(
+    EnvStream* file, const EnvPair* pair);
+template EnvReader::read_result EnvReader::read_pair<NodeDialect>(
+    EnvStream* file, const EnvPair* pair);
+template EnvReader::read_result EnvReader::read_pair<PlainDialect>(
+    EnvStream* file, const EnvPair* pair);
+template int EnvReader::read_pairs<FullDialect>(
+    EnvStream* file, std::vector<EnvPair*>* pairs, EnvValueSink* sink);
+template int EnvReader::read_pairs<NodeDialect>(
+    EnvStream* file, std::vector<EnvPair*>* pairs, EnvValueSink* sink);
+template int EnvReader::read_pairs<PlainDialect>(
+    EnvStream* file, std::vector<EnvPair*>* pairs, EnvValueSink* sink);
 }  // namespace cppnv
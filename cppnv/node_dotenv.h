@@ -2,50 +2,320 @@
 #define SRC_NODE_DOTENV_H_
 
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <map>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+namespace cppnv {
+class EnvPrefixIndex;
+}  // namespace cppnv
+
 namespace node {
 
+class Environment;
+
 class Dotenv {
+  struct TypedValue;
+
  public:
   Dotenv() = default;
-  Dotenv(const Dotenv& d) = default;
+  // Copies only the store; caches that point into it are rebuilt.
+  Dotenv(const Dotenv& d);
   Dotenv(Dotenv&& d) noexcept = default;
   Dotenv& operator=(Dotenv&& d) noexcept = default;
-  Dotenv& operator=(const Dotenv& d) = default;
+  Dotenv& operator=(const Dotenv& d);
   ~Dotenv() = default;
 
+  void SetEnvironment(Environment* env);
+#ifndef _WIN32
+  // Applies the whole store to the process environment in one pass instead
+  // of one setenv() per key. Variables that already exist are only replaced
+  // when override is true. Returns false if the new environ can't be
+  // allocated, in which case the environment is left untouched.
+  bool SetProcessEnvironment(bool override);
+
+  // Returns a NULL terminated KEY=value array for execve()/posix_spawn()
+  // with the store overlaid on base (just the store when base is null). The
+  // array and its strings live in one block that is built on first use and
+  // reused until the store changes or base holds different entry pointers,
+  // so spawning many children doesn't allocate. The pointer stays valid
+  // until then. Strings in base must not be changed in place while the
+  // block is in use; environ is not a default because setenv() and
+  // putenv() change it under the caller.
+  char* const* GetEnvp(char* const* base);
+
+  // Publishes the store as the next generation of the shared image called
+  // name (see SharedEnvImage), so other processes can map it instead of
+  // parsing the same files again. Values are often credentials, so only
+  // the owner can read the image unless mode says otherwise.
+  bool PublishSnapshot(const std::string& name, mode_t mode = 0600) const;
+#endif
   bool ParsePath(const std::string_view path);
+  // Like ParsePath, but of the [name] sections in path only those called
+  // profile are parsed, after the shared preamble (see EnvSectionIndex).
+  // Returns false if path can't be read or has no such section.
+  bool ParseProfile(const std::string_view path,
+                    const std::string_view profile);
+  // Parses every file in directory whose name ends in suffix, such as the
+  // fragments of an env.d directory, and stores them in lexical filename
+  // order so later fragments override earlier ones. Hidden files and
+  // subdirectories are skipped. Fragments are read and parsed on up to
+  // threads workers (one per core when 0) that steal work from each other,
+  // since fragment sizes vary too much to split evenly up front. Returns
+  // false, storing nothing, if directory can't be listed or a fragment
+  // can't be read.
+  bool ParseDirectory(const std::string_view directory,
+                      const std::string_view suffix = ".env",
+                      size_t threads = 0);
+  // Turns on a process-wide cache of ParsePath results (off by default).
+  // Files are identified by device, inode, size and modification time, so
+  // parsing an unchanged file again costs a stat() and a hash lookup. A file
+  // whose identity changed but whose content hashes the same as one already
+  // parsed reuses that result. Safe to use from several threads.
+  static void SetParseCacheEnabled(bool enabled);
+  static void ClearParseCache();
   void AssignNodeOptionsIfAvailable(std::string* node_options);
- 
+
+  // Typed reads for hot paths. A value is converted on first use and the
+  // result, failures included, is cached next to it until the store
+  // changes, so later reads are a lookup and a flag test. Each returns
+  // false if key isn't set or its value doesn't convert. Keys that aren't
+  // set aren't cached.
+  //
+  // GetInt takes a decimal integer. GetBool takes true/false, yes/no,
+  // on/off or 1/0 in any case. GetDuration takes integers with units (ns,
+  // us, ms, s, m, h, d), such as 1h30m. GetBytes takes an integer with an
+  // optional K, M, G or T suffix: powers of 1000, or of 1024 with an i
+  // after it, and an optional trailing B (512MiB, 2G, 64KB).
+  bool GetInt(std::string_view key, int64_t* value);
+  bool GetBool(std::string_view key, bool* value);
+  bool GetDuration(std::string_view key, std::chrono::nanoseconds* value);
+  bool GetBytes(std::string_view key, uint64_t* value);
+
+  // A key kept by the caller for reading the same value repeatedly. It
+  // remembers where the cached conversions are, so until the store changes
+  // a read through it is a generation check, a load and a flag test, with
+  // no lookup at all.
+  class TypedKey {
+   public:
+    explicit TypedKey(std::string_view key) : key_(key) {}
+
+   private:
+    friend class Dotenv;
+    std::string key_;
+    TypedValue* slot_ = nullptr;
+    uint64_t generation_ = 0;
+  };
+  bool GetInt(TypedKey* key, int64_t* value);
+  bool GetBool(TypedKey* key, bool* value);
+  bool GetDuration(TypedKey* key, std::chrono::nanoseconds* value);
+  bool GetBytes(TypedKey* key, uint64_t* value);
+
+  // An index over the store for pulling out every key under a prefix, such
+  // as all the DB_ settings, built on first use and kept until the store
+  // changes. Its views point into the store and are valid until then.
+  const cppnv::EnvPrefixIndex& GetPrefixIndex();
+
 
   static std::vector<std::string> GetPathFromArgs(
       const std::vector<std::string>& args);
 
  private:
   void ParseLine(const std::string_view line);
+  void StoreEntries(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+  void InvalidateCaches();
+
+  enum TypedKind : uint8_t {
+    kInt = 1 << 0,
+    kBool = 1 << 1,
+    kDuration = 1 << 2,
+    kBytes = 1 << 3
+  };
+  struct TypedValue {
+    // The store value this caches conversions of.
+    const std::string* text = nullptr;
+    // The kinds tried so far, and those that converted.
+    uint8_t converted = 0;
+    uint8_t valid = 0;
+    bool boolean = false;
+    int64_t integer = 0;
+    int64_t nanoseconds = 0;
+    uint64_t bytes = 0;
+  };
+  // Names the current typed_values_ for TypedKey. It changes whenever they
+  // are dropped, and a Dotenv that is moved from gets a new one since its
+  // typed_values_ went with the move.
+  class TypedGeneration {
+    uint64_t value_ = Next();
+
+   public:
+    TypedGeneration() = default;
+    TypedGeneration(TypedGeneration&& other) noexcept;
+    TypedGeneration& operator=(TypedGeneration&& other) noexcept;
+    [[nodiscard]] uint64_t value() const {
+      return value_;
+    }
+    void Advance() {
+      value_ = Next();
+    }
+    static uint64_t Next();
+  };
+  TypedValue* FindTyped(std::string_view key);
+  static const TypedValue* Convert(TypedValue* entry, TypedKind kind);
+  const TypedValue* ConvertOnce(std::string_view key, TypedKind kind);
+  const TypedValue* ConvertOnce(TypedKey* key, TypedKind kind);
+
   std::map<std::string, std::string> store_;
+  std::map<std::string, TypedValue, std::less<>> typed_values_;
+  TypedGeneration typed_generation_;
+  std::shared_ptr<const cppnv::EnvPrefixIndex> prefix_index_;
+#ifndef _WIN32
+  std::shared_ptr<char*> envp_;
+  char* const* envp_base_ = nullptr;
+  // The entries base held when envp_ was built.
+  std::vector<const char*> envp_base_entries_;
+#endif
+};
+
+#ifndef _WIN32
+/**
+ * \brief A read-only KEY=value image in POSIX shared memory, for process
+ * pools where one process parses the env files and the others only read
+ * them. The image only holds offsets, so it can be mapped at any address,
+ * and keys are found through a hash index in place, without copying.
+ *
+ * name (which must start with '/') is a small control segment holding the
+ * current generation; generation g lives in its own segment, name.g.
+ * Publish claims a generation of its own and writes it in full before
+ * bumping the counter, so readers either see the old image or a complete
+ * new one; concurrent publishers never share a segment, and the counter
+ * only moves forward. A publisher that dies mid-way leaves its segment
+ * behind but blocks no one. A mapped image
+ * stays valid after a newer one replaces it; IsStale() tells a reader when
+ * to Open() again. Segments are created with mode, 0600 by default; readers
+ * running as another user need a wider one.
+ */
+class SharedEnvImage {
+ public:
+  // Maps the current generation of name. Returns nullptr if nothing has been
+  // published under name or it can't be mapped.
+  static std::unique_ptr<SharedEnvImage> Open(const std::string& name);
+  static bool Publish(const std::string& name,
+                      const std::map<std::string, std::string>& entries,
+                      mode_t mode = 0600);
+  // Removes the control segment and the current generation.
+  static void Unlink(const std::string& name);
+
+  SharedEnvImage(const SharedEnvImage&) = delete;
+  SharedEnvImage& operator=(const SharedEnvImage&) = delete;
+  ~SharedEnvImage();
+
+  // The returned view points into the mapping and lives as long as it does.
+  bool Get(std::string_view key, std::string_view* value) const;
+  size_t Size() const;
+  uint64_t Generation() const;
+  bool IsStale() const;
+
+ private:
+  SharedEnvImage() = default;
+
+  const char* image_ = nullptr;
+  size_t image_size_ = 0;
+  std::atomic<uint64_t>* control_ = nullptr;
 };
+#endif
 
 }  // namespace node
 
 namespace cppnv {
 
-struct VariablePosition {
-  ~VariablePosition() {
-    delete variable_str;
+/**
+ * \brief A vector that keeps its first N elements inline and only goes to
+ * the heap past that. Elements must be trivially copyable.
+ */
+template <typename T, size_t N>
+class InlineVector {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+  alignas(T) unsigned char inline_[N * sizeof(T)];
+  T* data_ = reinterpret_cast<T*>(inline_);
+  size_t size_ = 0;
+  size_t capacity_ = N;
+
+ public:
+  InlineVector() = default;
+  InlineVector(const InlineVector&) = delete;
+  InlineVector& operator=(const InlineVector&) = delete;
+
+  ~InlineVector() {
+    if (!is_inline()) {
+      operator delete(data_);
+    }
   }
 
+  [[nodiscard]] bool is_inline() const {
+    return data_ == reinterpret_cast<const T*>(inline_);
+  }
+
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+  T& operator[](const size_t i) { return data_[i]; }
+  const T& operator[](const size_t i) const { return data_[i]; }
+  T& back() { return data_[size_ - 1]; }
+  T* begin() { return data_; }
+  T* end() { return data_ + size_; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+
+  void push_back(const T& item) {
+    if (size_ == capacity_) {
+      const size_t capacity = capacity_ * 2;
+      T* data = static_cast<T*>(operator new(capacity * sizeof(T)));
+      memcpy(data, data_, size_ * sizeof(T));
+      if (!is_inline()) {
+        operator delete(data_);
+      }
+      data_ = data;
+      capacity_ = capacity;
+    }
+    data_[size_++] = item;
+  }
+
+  void pop_back() { size_--; }
+  // Keeps any heap storage so it can be reused.
+  void clear() { size_ = 0; }
+};
+
+// Positions are indexes into the value buffer. The variable name is the
+// range [variable_start, variable_end].
+struct VariablePosition {
   VariablePosition(int variable_start, int start_brace, int dollar_sign);
   int variable_start;
   int start_brace;
   int dollar_sign;
   int end_brace;
   int variable_end;
-  std::string* variable_str;
   bool closed = false;
+  // ${name-default} and ${name:-default}: the default is the text in
+  // [default_start, default_end), used when name is not defined or, with
+  // default_if_empty (the :- form), defined but empty. -1 when there is no
+  // default.
+  int default_start = -1;
+  int default_end = -1;
+  bool default_if_empty = false;
 };
 class EnvStream {
   size_t index_ = 0;
@@ -55,14 +325,68 @@ class EnvStream {
 
  public:
   explicit EnvStream(std::string* data);
+  // Reads data from start up to end instead of all of it.
+  EnvStream(std::string* data,
+            size_t start,
+            size_t end = std::string::npos);
   char get();
   [[nodiscard]] bool good() const;
   [[nodiscard]] bool eof() const;
+  // The unread part of the stream, for readers that consume runs of
+  // characters at once instead of calling get() for each.
+  [[nodiscard]] const char* cursor() const;
+  [[nodiscard]] size_t remaining() const;
+  [[nodiscard]] size_t position() const;
+  void skip(size_t count);
+};
+/**
+ * \brief A copy of the process environment taken once and hashed, so
+ * interpolation can fall back to it with O(1) lookups instead of a getenv()
+ * scan per reference. Only the first definition of a name counts, like
+ * getenv().
+ */
+class EnvironmentSnapshot {
+  std::string buffer_;
+  std::unordered_map<std::string_view, std::string_view> values_;
+
+ public:
+  // Snapshots envp, or environ when envp is null.
+  explicit EnvironmentSnapshot(const char* const* envp = nullptr);
+  EnvironmentSnapshot(const EnvironmentSnapshot&) = delete;
+  EnvironmentSnapshot& operator=(const EnvironmentSnapshot&) = delete;
+
+  bool find(std::string_view name, std::string_view* value) const;
+  [[nodiscard]] size_t size() const {
+    return values_.size();
+  }
+};
+/**
+ * \brief Receives a value in decoded chunks while it is being read, so a
+ * large value (a certificate bundle in a heredoc, say) can be written
+ * straight to a file, a TLS context or a mapping instead of growing the
+ * reader's buffer and being copied again. Only values that reach
+ * threshold() bytes go to the sink; smaller ones are read as usual.
+ *
+ * A sunk value is taken literally (${...} in it isn't interpolated) and its
+ * pair is left with an empty value, which is also what references to it
+ * expand to.
+ */
+class EnvValueSink {
+ public:
+  virtual ~EnvValueSink() = default;
+  [[nodiscard]] virtual size_t threshold() const {
+    return 64 * 1024;
+  }
+  virtual void begin(const std::string& key) = 0;
+  virtual void write(const char* data, size_t length) = 0;
+  virtual void end() = 0;
 };
 struct EnvValue {
   std::string* value;
   bool is_parsing_variable = false;
-  std::vector<VariablePosition*>* interpolations;
+  // Most values have no more than a couple of interpolations, so they never
+  // allocate for them.
+  InlineVector<VariablePosition, 4> interpolations;
   int interpolation_index = 0;
   bool quoted = false;
   bool triple_quoted = false;
@@ -78,6 +402,10 @@ struct EnvValue {
   int single_quote_streak = 0;
   int double_quote_streak = 0;
   std::string* own_buffer;
+  EnvValueSink* sink = nullptr;
+  const std::string* sink_key = nullptr;
+  // Bytes already handed to sink.
+  size_t sunk = 0;
 
 
   void clip_own_buffer(int length) const {
@@ -94,16 +422,35 @@ struct EnvValue {
     value = buff;
   }
 
+  // Puts the value back in its freshly constructed state so it can be read
+  // into again. An own buffer is kept (and read into directly) to reuse its
+  // capacity.
+  void reset() {
+    interpolations.clear();
+    value = own_buffer;
+    is_parsing_variable = false;
+    interpolation_index = 0;
+    quoted = false;
+    triple_quoted = false;
+    double_quoted = false;
+    triple_double_quoted = false;
+    implicit_double_quote = false;
+    back_tick_quoted = false;
+    value_index = 0;
+    is_already_interpolated = false;
+    is_being_interpolated = false;
+    did_over_flow = false;
+    back_slash_streak = 0;
+    single_quote_streak = 0;
+    double_quote_streak = 0;
+    sunk = 0;
+  }
+
   EnvValue(): value(nullptr), own_buffer(nullptr) {
-    interpolations = new std::vector<VariablePosition*>();
   }
 
   ~EnvValue() {
-    for (const auto interpolation : *interpolations) {
-      delete interpolation;
-    }
     delete own_buffer;
-    delete interpolations;
   }
 };
 class EnvKey {
@@ -136,6 +483,14 @@ class EnvKey {
     key = buff;
   }
 
+  void reset() {
+    key = own_buffer;
+    if (own_buffer != nullptr) {
+      own_buffer->clear();
+    }
+    key_index = 0;
+  }
+
   ~EnvKey() {
     delete own_buffer;
   }
@@ -144,6 +499,129 @@ struct EnvPair {
   EnvKey* key;
   EnvValue* value;
 };
+/**
+ * \brief A parse result laid out as parallel arrays over one character
+ * buffer instead of separately allocated EnvPair objects, so iterating,
+ * sorting and hashing large files doesn't chase pointers.
+ *
+ * Pair i has its key at key_offsets[i] and its value at value_offsets[i] in
+ * buffer. Its interpolations are entries [interpolation_offsets[i],
+ * interpolation_offsets[i + 1]) of the interpolation arrays, with positions
+ * relative to the start of the value. Values are not finalized.
+ */
+struct EnvPairTable {
+  enum value_flag : uint8_t {
+    quoted = 1 << 0,
+    triple_quoted = 1 << 1,
+    double_quoted = 1 << 2,
+    triple_double_quoted = 1 << 3,
+    implicit_double_quote = 1 << 4,
+    back_tick_quoted = 1 << 5
+  };
+
+  std::string buffer;
+  std::vector<uint32_t> key_offsets;
+  std::vector<uint32_t> key_lengths;
+  std::vector<uint32_t> value_offsets;
+  std::vector<uint32_t> value_lengths;
+  std::vector<uint8_t> flags;
+  std::vector<uint32_t> interpolation_offsets{0};
+  std::vector<uint32_t> dollar_signs;
+  std::vector<uint32_t> end_braces;
+  std::vector<uint32_t> variable_starts;
+  std::vector<uint32_t> variable_lengths;
+
+  [[nodiscard]] size_t size() const {
+    return key_offsets.size();
+  }
+
+  [[nodiscard]] std::string_view key(const size_t i) const {
+    return std::string_view(buffer).substr(key_offsets[i], key_lengths[i]);
+  }
+
+  [[nodiscard]] std::string_view value(const size_t i) const {
+    return std::string_view(buffer).substr(value_offsets[i],
+                                           value_lengths[i]);
+  }
+
+  [[nodiscard]] bool has_flag(const size_t i, const value_flag flag) const {
+    return (flags[i] & flag) != 0;
+  }
+
+  [[nodiscard]] size_t interpolation_count(const size_t i) const {
+    return interpolation_offsets[i + 1] - interpolation_offsets[i];
+  }
+
+  void append(const EnvPair* pair);
+  void clear();
+};
+/**
+ * \brief Dialects pick which value syntax EnvReader understands. Each is a
+ * set of compile time switches; a feature that is off is compiled out of
+ * the reader, and its characters are read as plain text.
+ *
+ * FullDialect is everything EnvReader has always read. NodeDialect keeps
+ * the ', " and ` quotes Dotenv::ParseLine knows, without heredocs, escapes
+ * or interpolation, but reads them by EnvReader's rules, so it is not a
+ * drop-in for ParseLine:
+ *  - a quoted value ends at its first closing quote and the rest of the
+ *    line is dropped; a="x"y" is x, where ParseLine cuts at the last quote
+ *    and gives x"y.
+ *  - a quoted value may run over several lines; ParseLine sees one line.
+ *  - turning heredocs off doesn't make triple quotes plain text. A value
+ *    opening with three quotes is the empty '' or "" value, and the rest
+ *    of its line is dropped; a='''h''' is empty, ParseLine gives ''h''.
+ * PlainDialect reads KEY=value lines with comments and nothing else.
+ */
+struct FullDialect {
+  static constexpr bool quotes = true;
+  static constexpr bool back_ticks = true;
+  static constexpr bool heredocs = true;
+  static constexpr bool escapes = true;
+  static constexpr bool interpolation = true;
+};
+
+struct NodeDialect {
+  static constexpr bool quotes = true;
+  static constexpr bool back_ticks = true;
+  static constexpr bool heredocs = false;
+  static constexpr bool escapes = false;
+  static constexpr bool interpolation = false;
+};
+
+struct PlainDialect {
+  static constexpr bool quotes = false;
+  static constexpr bool back_ticks = false;
+  static constexpr bool heredocs = false;
+  static constexpr bool escapes = false;
+  static constexpr bool interpolation = false;
+};
+
+/**
+ * \brief Where the [name] sections of a document are, found with a line
+ * scan that doesn't tokenize anything, so one profile can be read without
+ * parsing the others. A line holding only [name] (surrounding spaces
+ * aside) starts a section, even inside a quoted or heredoc value, and the
+ * section runs to the next such line. What comes before the first one is
+ * the preamble every profile shares. A name may head several sections.
+ */
+class EnvSectionIndex {
+ public:
+  explicit EnvSectionIndex(std::string_view text);
+
+  [[nodiscard]] size_t preamble_end() const {
+    return preamble_end_;
+  }
+  // The [start, end) byte ranges of the sections called name, in order, or
+  // nullptr if there are none.
+  [[nodiscard]] const std::vector<std::pair<size_t, size_t>>* find(
+      std::string_view name) const;
+
+ private:
+  size_t preamble_end_;
+  std::unordered_map<std::string, std::vector<std::pair<size_t, size_t>>>
+      sections_;
+};
 class EnvReader {
  public:
   enum read_result {
@@ -163,6 +641,7 @@ class EnvReader {
       const EnvValue* value,
       int* position);
   static read_result read_key(EnvStream* file, EnvKey* key);
+  static bool read_simple_pair(EnvStream* file, const EnvPair* pair);
   static int get_white_space_offset_left(const std::string* value,
                                          const VariablePosition*
                                          interpolation);
@@ -179,21 +658,409 @@ class EnvReader {
   static bool walk_double_quotes(EnvValue* value);
   static bool walk_single_quotes(EnvValue* value);
   static void add_to_buffer(EnvValue* value, char key_char);
+  static void grow_buffer(EnvValue* value, size_t count);
+  static void add_run_to_buffer(EnvValue* value,
+                                const char* data,
+                                size_t length);
+  static void sink_buffer(EnvValue* value);
+  static void finish_sink(EnvValue* value);
+  static bool can_read_escaped_run(const EnvValue* value);
+  static void read_escaped_run(EnvStream* file,
+                               EnvValue* value,
+                               char* last_char);
+  template <typename Dialect>
   static bool read_next_char(EnvValue* value, char key_char);
   static bool is_previous_char_an_escape(const EnvValue* value);
 
+  template <typename Dialect>
   static read_result read_value(EnvStream* file, EnvValue* value);
   static void remove_unclosed_interpolation(EnvValue* value);
+  static finalize_result finalize_value_step(
+      const EnvPair* pair,
+      std::vector<EnvPair*>* pairs,
+      const EnvironmentSnapshot* environment);
+  static void finalize_resolved(const EnvPair* pair,
+                                const std::vector<EnvPair*>* pairs,
+                                const size_t* targets,
+                                const std::vector<bool>& cyclic,
+                                const EnvironmentSnapshot* environment);
 
  public:
   static finalize_result finalize_value(const EnvPair* pair,
                                         std::vector<EnvPair*>* pairs);
+  // Names that no pair defines are looked up in environment (when not
+  // null) before falling back to the reference's default.
+  static finalize_result finalize_value(
+      const EnvPair* pair,
+      std::vector<EnvPair*>* pairs,
+      const EnvironmentSnapshot* environment);
+  /**
+   * \brief Finalizes all pairs in one pass over the interpolation graph,
+   * O(pairs + references), instead of one finalize_value per pair.
+   * Every circular reference is found: each strongly connected component
+   * that forms a cycle is appended to cycles (when not null) and its pairs
+   * are left as written. References into a cycle are left as written too,
+   * everything else still resolves.
+   * Names no pair defines are looked up in environment, when not null.
+   * \return circular if there was at least one cycle, interpolated otherwise
+   */
+  static finalize_result finalize_pairs(
+      std::vector<EnvPair*>* pairs,
+      std::vector<std::vector<EnvPair*>>* cycles,
+      const EnvironmentSnapshot* environment = nullptr);
+  template <typename Dialect = FullDialect>
   static read_result read_pair(EnvStream* file, const EnvPair* pair);
 
-  static int read_pairs(EnvStream* file, std::vector<EnvPair*>* pairs);
+  // Values that reach sink->threshold() bytes go to sink (when not null)
+  // instead of their pair, see EnvValueSink.
+  template <typename Dialect = FullDialect>
+  static int read_pairs(EnvStream* file,
+                        std::vector<EnvPair*>* pairs,
+                        EnvValueSink* sink = nullptr);
+  static int read_pairs(EnvStream* file, EnvPairTable* table);
+  /**
+   * \brief Reads the preamble of text and then its sections called
+   * profile, leaving the other sections unread. Preamble pairs whose key
+   * the profile sets again are dropped, so the profile's value is the one
+   * interpolation and the caller see, and profile values can reference
+   * the shared keys.
+   * \return false, reading nothing, if text has no such section
+   */
+  static bool read_profile(std::string* text,
+                           const EnvSectionIndex& index,
+                           std::string_view profile,
+                           std::vector<EnvPair*>* pairs);
   static void delete_pair(const EnvPair* pair);
   static void delete_pairs(const std::vector<EnvPair*>* pairs);
 };
+/**
+ * \brief Pulls pairs out of an EnvStream as they are parsed, so a caller can
+ * validate, filter or forward each one (or stop early) without reading the
+ * rest of the stream first.
+ *
+ * Every returned pair belongs to the caller and is deleted with
+ * EnvReader::delete_pair. Pairs without interpolations come back finalized.
+ * Pairs with interpolations may reference keys further down the stream, so
+ * finalizing them is left to the caller once those keys have been read.
+ */
+class EnvPairReader {
+  EnvStream* file_;
+  std::string buffer_;
+  bool done_ = false;
+
+ public:
+  explicit EnvPairReader(EnvStream* file);
+  // Returns the next pair, or nullptr once the stream is exhausted.
+  EnvPair* next();
+};
+/**
+ * \brief Finalizes pairs while the stream is still being read. A pair is
+ * returned as soon as every key it references has its final value, so
+ * backward references resolve without waiting for the end of the stream.
+ * Pairs with forward references wait until their keys arrive; whatever is
+ * still waiting at the end of the stream is finalized then, the same way
+ * finalize_pairs would (unknown and circular references stay as written).
+ * A reference with a default, ${a-b}, also waits unless a key or environment
+ * variable named a-b is already known, since one could still be defined.
+ *
+ * Values match finalize_value over the whole file, but pairs that had to
+ * wait come out after the ones that didn't. A resolved value is only kept
+ * while something further down the stream or still waiting references it,
+ * so memory follows what is outstanding rather than the size of the file.
+ * The caller owns every returned pair.
+ */
+class EnvPairResolver {
+  struct Definition {
+    const EnvPair* first = nullptr;
+    bool resolved = false;
+    // Queued in releasing_.
+    bool releasing = false;
+    std::string value;
+  };
+  struct Pending {
+    EnvPair* pair;
+    size_t missing;
+  };
+  using Definitions = std::unordered_map<std::string, Definition>;
+
+  EnvPairReader reader_;
+  EnvStream* file_;
+  const EnvironmentSnapshot* environment_;
+  // The first definition of every key seen so far, like finalize_value,
+  // less the resolved ones nothing can reference any more.
+  Definitions definitions_;
+  // Indexes into pending_ of the pairs waiting on each unresolved key.
+  std::unordered_map<std::string, std::vector<size_t>> waiters_;
+  std::vector<Pending> pending_;
+  size_t pending_count_ = 0;
+  std::vector<EnvPair*> ready_;
+  size_t ready_index_ = 0;
+  bool flushed_ = false;
+
+  // Where in the stream each name is last referenced, from a scan of the
+  // input up front. When the scan can't tell, every definition is kept.
+  std::unordered_map<std::string, size_t> last_references_;
+  bool keep_definitions_ = false;
+  // How many references pending pairs hold to each name.
+  std::unordered_map<std::string, size_t> mentions_;
+  // Resolved definitions by the last position that references them.
+  std::multimap<size_t, std::string> expiring_;
+  std::vector<Definitions::iterator> releasing_;
+  // Where the pair being added starts.
+  size_t position_ = 0;
+
+  void scan_references();
+  void add(EnvPair* pair);
+  void resolve(EnvPair* pair);
+  void substitute(const EnvPair* pair) const;
+  void flush();
+  void mention(const EnvPair* pair, bool add);
+  [[nodiscard]] bool needed(const std::string& name) const;
+  void release(Definitions::iterator definition);
+
+ public:
+  // References to names the stream never defines fall back to environment
+  // (when not null) once the stream ends.
+  explicit EnvPairResolver(EnvStream* file,
+                           const EnvironmentSnapshot* environment = nullptr);
+  ~EnvPairResolver();
+  EnvPairResolver(const EnvPairResolver&) = delete;
+  EnvPairResolver& operator=(const EnvPairResolver&) = delete;
+  // Returns the next finalized pair, or nullptr once every pair has been
+  // returned.
+  EnvPair* next();
+};
+/**
+ * \brief A reusable parser for callers that parse many documents. Pairs,
+ * their key and value buffers, their interpolation storage and the result
+ * vector are recycled between calls, so once documents of a given shape have
+ * been seen, parsing more of them doesn't allocate. finalize_value still
+ * allocates for values with interpolations.
+ */
+class EnvReaderContext {
+  std::string buffer_;
+  std::vector<EnvPair*> pairs_;
+  std::vector<EnvPair*> pool_;
+
+  EnvPair* acquire_pair();
+
+ public:
+  EnvReaderContext();
+  EnvReaderContext(const EnvReaderContext&) = delete;
+  EnvReaderContext& operator=(const EnvReaderContext&) = delete;
+  ~EnvReaderContext();
+
+  // Parses file, replacing the previous result. The pairs belong to the
+  // context and stay valid until the next call or until it is destroyed.
+  const std::vector<EnvPair*>& read_pairs(EnvStream* file);
+  [[nodiscard]] const std::vector<EnvPair*>& pairs() const {
+    return pairs_;
+  }
+};
+/**
+ * \brief A parsed document that is edited in place, for editors and tools
+ * that reparse on every change. Every read_pair call is kept as a span of
+ * the text, with the pair it produced or null for comments and lines that
+ * don't parse. Pairs are as read_pairs returns them, not finalized.
+ *
+ * The reader starts every pair afresh, so the parse from a span boundary
+ * only depends on the text after it. An edit reparses from the span before
+ * the one it touches (a span may have looked one character past its end)
+ * until a new span ends on an old boundary past the edit. The spans from
+ * there on are kept and only shifted. An edit that opens or closes a quote
+ * or heredoc reparses as far as that changes the spans, and no further.
+ */
+class EnvDocument {
+ public:
+  struct Span {
+    size_t start;
+    size_t end;
+    EnvPair* pair;
+  };
+
+  explicit EnvDocument(std::string text);
+  EnvDocument(const EnvDocument&) = delete;
+  EnvDocument& operator=(const EnvDocument&) = delete;
+  ~EnvDocument();
+
+  // Replaces length bytes at offset with replacement. The spans that were
+  // reparsed are [*first, *first + *count), when those aren't null.
+  // Returns false, changing nothing, if the range is outside the text.
+  bool edit(size_t offset,
+            size_t length,
+            std::string_view replacement,
+            size_t* first = nullptr,
+            size_t* count = nullptr);
+
+  [[nodiscard]] const std::string& text() const {
+    return text_;
+  }
+  // Spans cover the text in order. The pairs belong to the document and
+  // live until the edit that reparses their span.
+  [[nodiscard]] const std::vector<Span>& spans() const {
+    return spans_;
+  }
+
+ private:
+  // Reads spans from start into out, stopping early once one ends at an
+  // old boundary at or past resync_from (in the new text); *resume is then
+  // the index of the old span starting there.
+  void read_spans(size_t start,
+                  size_t resync_from,
+                  ptrdiff_t delta,
+                  size_t old_index,
+                  std::vector<Span>* out,
+                  size_t* resume);
+
+  std::string text_;
+  std::string buffer_;
+  std::vector<Span> spans_;
+};
+/**
+ * \brief A radix trie over sorted keys for namespace queries such as every
+ * key starting with REDIS_. Keys and values are views, nothing is copied.
+ * Each trie node covers the contiguous run of sorted entries below it, so
+ * a query costs O(|prefix|) and its result is a slice walked in
+ * O(results). A view can strip its prefix and be queried again, which
+ * gives a component its own section of the configuration.
+ */
+class EnvPrefixIndex {
+ public:
+  class View {
+   public:
+    [[nodiscard]] size_t size() const;
+    [[nodiscard]] bool empty() const {
+      return size() == 0;
+    }
+    // The i-th entry in key order, key without the stripped part.
+    std::pair<std::string_view, std::string_view> operator[](size_t i) const;
+    // The entries of this view whose (stripped) key starts with prefix.
+    [[nodiscard]] View find(std::string_view prefix) const;
+    // The same entries, with prefix stripped from their keys as well.
+    [[nodiscard]] View strip(std::string_view prefix) const;
+
+   private:
+    friend class EnvPrefixIndex;
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    View(const EnvPrefixIndex* index,
+         uint32_t node,
+         uint32_t matched,
+         uint32_t stripped)
+      : index_(index), node_(node), matched_(matched), stripped_(stripped) {
+    }
+    [[nodiscard]] View descend(std::string_view prefix, bool strip) const;
+
+    const EnvPrefixIndex* index_;
+    uint32_t node_;
+    // How much of every key in the view is known to match, and how much of
+    // that is hidden.
+    uint32_t matched_;
+    uint32_t stripped_;
+  };
+
+  // The keys and values must outlive the index.
+  explicit EnvPrefixIndex(const std::map<std::string, std::string>& entries);
+  explicit EnvPrefixIndex(const std::vector<EnvPair*>& pairs);
+
+  [[nodiscard]] View all() const;
+  [[nodiscard]] View find(std::string_view prefix) const {
+    return all().find(prefix);
+  }
+  [[nodiscard]] View strip(std::string_view prefix) const {
+    return all().strip(prefix);
+  }
+
+ private:
+  struct Node {
+    // The entries [begin, end) share the first depth characters.
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+    // Children are stored together, ordered by their next character.
+    uint32_t first_child;
+    uint32_t child_count;
+  };
+
+  void build();
+
+  std::vector<std::pair<std::string_view, std::string_view>> entries_;
+  std::vector<Node> nodes_;
+};
+/**
+ * \brief Writes pairs back out as dotenv text that EnvReader::read_pairs
+ * reads back to the same keys and values.
+ *
+ * Each value gets the cheapest quoting that survives the round trip: bare,
+ * '...', "..." with control codes escaped, or a '''...''' heredoc. Values
+ * that were read but not finalized keep their interpolations live, so they
+ * are only written bare or double quoted. The output size is computed up
+ * front and the text is written in a single pass.
+ */
+class EnvWriter {
+ public:
+  enum write_result {
+    success,
+    invalid_key,
+    invalid_value,
+    buffer_too_small,
+    io_error
+  };
+
+  enum quote_style : uint8_t {
+    bare,
+    single_quoted,
+    double_quoted,
+    triple_single_quoted,
+    unrepresentable
+  };
+
+  static quote_style pick_style(std::string_view value,
+                                bool keep_interpolations);
+  static write_result serialized_size(const std::vector<EnvPair*>* pairs,
+                                      size_t* size);
+  static write_result write_pairs(const std::vector<EnvPair*>* pairs,
+                                  char* buffer,
+                                  size_t size,
+                                  size_t* written);
+  static write_result write_pairs(const std::vector<EnvPair*>* pairs, int fd);
+
+ private:
+  static write_result measure(const std::vector<EnvPair*>* pairs,
+                              std::vector<quote_style>* styles,
+                              size_t* size);
+  static char* write_pair(char* out,
+                          const EnvPair* pair,
+                          quote_style style);
+};
+/**
+ * \brief Records ParsePath, ParseDirectory and each file it parses
+ * (ParseFile, on the worker's thread), read_pairs, finalize_pairs and
+ * finalize_value as Chrome trace events (chrome://tracing, Perfetto). While
+ * nothing is recording, each traced phase costs one relaxed atomic load.
+ *
+ * The same phases have USDT probes in the cppnv provider when sys/sdt.h is
+ * available at build time (parse_path__start/done, parse_file__start/done,
+ * read_pairs__start/done, finalize_pairs__start/done,
+ * finalize_value__start/done), which compile to a nop until a tracer
+ * attaches. A path that can't be read ends in parse_path__error or
+ * parse_file__error instead of the done probe, so every start is closed.
+ */
+class TraceEventWriter {
+ public:
+  // Starts recording, dropping anything recorded before.
+  static void Start();
+  // Stops recording and writes the events to path as trace event JSON.
+  static bool Stop(const std::string& path);
+  static bool IsRecording();
+  // Adds a complete event. Times are in microseconds; detail_name may be
+  // null when there is no detail to show.
+  static void Record(const char* name,
+                     uint64_t start,
+                     uint64_t duration,
+                     const char* detail_name,
+                     uint64_t detail);
+};
 }  // namespace cppnv
 #endif  // defined(NODE_WANT_INTERNALS) && NODE_WANT_INTERNALS
 
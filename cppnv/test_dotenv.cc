@@ -1,13 +1,104 @@
-﻿#include <string>
+﻿#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <string>
 #include <sstream>
+#include <thread>
 #include "gtest/gtest.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using cppnv::EnvPair;
 using cppnv::EnvReader;
 using cppnv::EnvStream;
 using std::string;
 
 
+// operator new is replaced for the whole test binary, but it only counts on
+// a thread while an AllocationCounter is alive there, so tests can check that
+// the APIs documented as allocation free really don't allocate without the
+// rest of the binary being affected.
+namespace {
+thread_local size_t counters = 0;
+thread_local size_t allocations = 0;
+thread_local size_t allocated_bytes = 0;
+
+class AllocationCounter {
+  size_t start_count_ = allocations;
+  size_t start_bytes_ = allocated_bytes;
+
+ public:
+  AllocationCounter() {
+    counters++;
+  }
+
+  ~AllocationCounter() {
+    counters--;
+  }
+
+  AllocationCounter(const AllocationCounter&) = delete;
+  AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+  [[nodiscard]] size_t count() const {
+    return allocations - start_count_;
+  }
+
+  [[nodiscard]] size_t bytes() const {
+    return allocated_bytes - start_bytes_;
+  }
+};
+
+// Every replacement below goes through this pair. Keeping them out of line
+// stops GCC from inlining a delete into its caller, seeing the pointer came
+// from operator new and warning that it reaches free.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* Allocate(const size_t size) noexcept {
+  if (counters != 0) {
+    allocations++;
+    allocated_bytes += size;
+  }
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void Release(void* memory) noexcept {
+  std::free(memory);
+}
+}  // namespace
+
+// The tests build without exceptions, so running out of memory aborts.
+void* operator new(const size_t size) {
+  if (void* memory = Allocate(size)) {
+    return memory;
+  }
+  std::abort();
+}
+
+void* operator new(const size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size);
+}
+
+void operator delete(void* memory) noexcept {
+  Release(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  Release(memory);
+}
+
 class DotEnvTest : public EnvironmentTestFixture {
 };
 
@@ -670,3 +761,1302 @@ TEST_F(DotEnvTest, InterpolateValuesEscaped) {
   EXPECT_EQ(*env_pairs.at(5)->value->value, "\\$ { a1}");
   EnvReader::delete_pairs(&env_pairs);
 }
+
+TEST_F(DotEnvTest, FinalizePairsReportsEveryCycle) {
+  string interpolate("a=${b}\n"
+      "b=${a}\n"
+      "self=x ${self}\n"
+      "uses_cycle=${a} and ${ok}\n"
+      "chain=${uses_cycle}!\n"
+      "ok=fine\n"
+      "missing=${nope}\n"
+      "c=${d}\n"
+      "d=${e}\n"
+      "e=${c}");
+  EnvStream interpolate_stream(&interpolate);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&interpolate_stream, &env_pairs);
+
+  std::vector<std::vector<EnvPair*>> cycles;
+  EXPECT_EQ(EnvReader::finalize_pairs(&env_pairs, &cycles),
+            EnvReader::circular);
+
+  ASSERT_EQ(cycles.size(), 3);
+  std::vector<std::vector<string>> cycle_keys;
+  for (const auto& cycle : cycles) {
+    std::vector<string> keys;
+    for (const auto pair : cycle) {
+      keys.push_back(*pair->key->key);
+    }
+    std::sort(keys.begin(), keys.end());
+    cycle_keys.push_back(keys);
+  }
+  std::sort(cycle_keys.begin(), cycle_keys.end());
+  EXPECT_EQ(cycle_keys[0], (std::vector<string>{"a", "b"}));
+  EXPECT_EQ(cycle_keys[1], (std::vector<string>{"c", "d", "e"}));
+  EXPECT_EQ(cycle_keys[2], (std::vector<string>{"self"}));
+
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "${b}");
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "x ${self}");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "${a} and fine");
+  EXPECT_EQ(*env_pairs.at(4)->value->value, "${a} and fine!");
+  EXPECT_EQ(*env_pairs.at(6)->value->value, "${nope}");
+  EXPECT_FALSE(env_pairs.at(0)->value->is_being_interpolated);
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, FinalizePairsLongChain) {
+  // Every pair finishes on top of the Tarjan stack, so a long acyclic chain
+  // is linear; scanning the stack from the bottom made this take seconds.
+  constexpr int kLength = 100000;
+  string interpolate;
+  for (int i = 0; i < kLength; i++) {
+    interpolate += "k" + std::to_string(i) + "=${k" + std::to_string(i + 1) +
+                   "}\n";
+  }
+  interpolate += "k" + std::to_string(kLength) + "=end\n" +
+                 "loop=${k0}${loop}\n";
+  EnvStream interpolate_stream(&interpolate);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&interpolate_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), kLength + 2u);
+
+  std::vector<std::vector<EnvPair*>> cycles;
+  EXPECT_EQ(EnvReader::finalize_pairs(&env_pairs, &cycles),
+            EnvReader::circular);
+  ASSERT_EQ(cycles.size(), 1u);
+  ASSERT_EQ(cycles[0].size(), 1u);
+  EXPECT_EQ(*cycles[0][0]->key->key, "loop");
+  for (int i = 0; i <= kLength; i++) {
+    ASSERT_EQ(*env_pairs.at(i)->value->value, "end");
+  }
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, FinalizeValueAfterCircular) {
+  string interpolate("b3=hello ${b4} ${a1}\n"
+      "b4=$ { b3}\n"
+      "a1=${a2} long value\n"
+      "a2=bc");
+  EnvStream interpolate_stream(&interpolate);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&interpolate_stream, &env_pairs);
+
+  for (int round = 0; round < 2; round++) {
+    for (const auto pair : env_pairs) {
+      EnvReader::finalize_value(pair, &env_pairs);
+    }
+    EXPECT_EQ(*env_pairs.at(0)->value->value, "hello ${b4} ${a1}");
+    EXPECT_FALSE(env_pairs.at(0)->value->is_being_interpolated);
+    EXPECT_EQ(*env_pairs.at(1)->value->value, "$ { b3}");
+    EXPECT_FALSE(env_pairs.at(1)->value->is_being_interpolated);
+    EXPECT_EQ(*env_pairs.at(2)->value->value, "bc long value");
+  }
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, InterpolationsSpillPastInlineStorage) {
+  string interpolate("a=1\n"
+      "two=${a}${a}\n"
+      "six=${a}${a}${a}${a}${a}${a}\n"
+      "open=${a} ${a");
+  EnvStream interpolate_stream(&interpolate);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&interpolate_stream, &env_pairs);
+
+  ASSERT_EQ(env_pairs.size(), 4);
+  EXPECT_TRUE(env_pairs.at(1)->value->interpolations.is_inline());
+  EXPECT_FALSE(env_pairs.at(2)->value->interpolations.is_inline());
+  EXPECT_EQ(env_pairs.at(3)->value->interpolations.size(), 1);
+  for (const auto pair : env_pairs) {
+    EnvReader::finalize_value(pair, &env_pairs);
+  }
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "11");
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "111111");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "1 ${a");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, SimpleLines) {
+  string simple("  spaced key  =   spaced value   \n"
+      "crlf=value\r\n"
+      "inner=a\rb \r\n"
+      "quotes=  \"not quoted\" it's `plain`\n"
+      "braces=}$ x $\n"
+      "tab=\tvalue\t\n"
+      "empty=\n"
+      "=no key\n"
+      "last=no newline\r");
+  EnvStream simple_stream(&simple);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&simple_stream, &env_pairs);
+
+  ASSERT_EQ(env_pairs.size(), 9);
+  EXPECT_EQ(*env_pairs.at(0)->key->key, "spaced key");
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "spaced value");
+  EXPECT_TRUE(env_pairs.at(0)->value->implicit_double_quote);
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "value");
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "a\rb");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "\"not quoted\" it's `plain`");
+  EXPECT_EQ(*env_pairs.at(4)->value->value, "}$ x $");
+  EXPECT_EQ(*env_pairs.at(5)->value->value, "\tvalue\t");
+  EXPECT_EQ(*env_pairs.at(6)->value->value, "");
+  EXPECT_EQ(*env_pairs.at(7)->key->key, "");
+  EXPECT_EQ(*env_pairs.at(7)->value->value, "no key");
+  EXPECT_EQ(*env_pairs.at(8)->key->key, "last");
+  EXPECT_EQ(*env_pairs.at(8)->value->value, "no newline\r");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, EscapeDenseValues) {
+  string codes(R"(json="{\"name\": \"cppnv\", )"
+      R"(\"tags\": [\"a\\\\b\", \"c\"]}")" "\n"
+      R"(pem="-----BEGIN-----\nMIIBIjANBgkqhkiG9w0BAQEFAAOC\n)"
+      R"(AQ8AMIIBCgKCAQEA\n-----END-----\n")" "\n"
+      R"(runs=a\\\\\\\\b\\\\\\\\\nc\\\\\\\\\\)" "\n"
+      R"(heredoc="""line\tone\\\\
+line "two" \q""")");
+  EnvStream codes_stream(&codes);
+
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&codes_stream, &env_pairs);
+
+  ASSERT_EQ(env_pairs.size(), 4);
+  EXPECT_EQ(*env_pairs.at(0)->value->value,
+            R"({"name": "cppnv", "tags": ["a\\b", "c"]})");
+  EXPECT_EQ(*env_pairs.at(1)->value->value,
+            "-----BEGIN-----\nMIIBIjANBgkqhkiG9w0BAQEFAAOC\nAQ8AMIIBCgKCAQEA\n"
+            "-----END-----\n");
+  EXPECT_EQ(*env_pairs.at(2)->value->value, R"(a\\\\b\\\\)" "\n" R"(c\\\\\)");
+  EXPECT_EQ(*env_pairs.at(3)->value->value,
+            "line\tone\\\\\nline \"two\" \\q");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, NodeDialect) {
+  string input("single='x${b}\\n'\n"
+      "double=\"q\\t${single}\"\n"
+      "tick=`quoted`\n"
+      "heredoc='''h'''\n"
+      "multi=\"two\nlines\"\n"
+      "inner=\"x\"y\"\n"
+      "open=\"\"\"\nnot a pair\n\"\"\"\n"
+      "after=1\n");
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs<cppnv::NodeDialect>(&env_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), 8);
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "x${b}\\n");
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "q\\t${single}");
+  EXPECT_TRUE(env_pairs.at(1)->value->interpolations.empty());
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "quoted");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "");
+  EXPECT_EQ(*env_pairs.at(4)->value->value, "two\nlines");
+  // Where ParseLine differs, see NodeDialect.
+  EXPECT_EQ(*env_pairs.at(5)->value->value, "x");
+  EXPECT_EQ(*env_pairs.at(6)->value->value, "");
+  EXPECT_EQ(*env_pairs.at(7)->key->key, "after");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, PlainDialect) {
+  string input("a='quoted' # comment\n"
+      "b=\"${a}\\n\"\n"
+      "c=   spaced   \n");
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs<cppnv::PlainDialect>(&env_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), 3);
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "'quoted'");
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "\"${a}\\n\"");
+  EXPECT_TRUE(env_pairs.at(1)->value->interpolations.empty());
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "spaced");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, InterpolationDefaults) {
+  string input("empty=\n"
+      "set=value\n"
+      "a=\"${missing-fallback}\"\n"
+      "b=\"${missing:-fallback}\"\n"
+      "c=\"${empty-fallback}\"\n"
+      "d=\"${empty:-fallback}\"\n"
+      "e=\"${set:-fallback} ${ set - other }\"\n");
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), 7);
+  for (const EnvPair* pair : env_pairs) {
+    EnvReader::finalize_value(pair, &env_pairs);
+  }
+  EXPECT_EQ(*env_pairs.at(2)->value->value, "fallback");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "fallback");
+  EXPECT_EQ(*env_pairs.at(4)->value->value, "");
+  EXPECT_EQ(*env_pairs.at(5)->value->value, "fallback");
+  EXPECT_EQ(*env_pairs.at(6)->value->value, "value value");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, InterpolationFallsBackToEnvironment) {
+  const char* envp[] = {"FROM_ENV=env", "EMPTY_ENV=", "SHADOWED=env", nullptr};
+  const cppnv::EnvironmentSnapshot environment(envp);
+  EXPECT_EQ(environment.size(), 3);
+  string input("SHADOWED=file\n"
+      "a=\"${FROM_ENV} ${SHADOWED} ${EMPTY_ENV:-default} ${NOWHERE}\"\n");
+
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  EnvReader::finalize_value(env_pairs.at(1), &env_pairs, &environment);
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "env file default ${NOWHERE}");
+  EnvReader::delete_pairs(&env_pairs);
+  env_pairs.clear();
+
+  EnvStream pairs_stream(&input);
+  EnvReader::read_pairs(&pairs_stream, &env_pairs);
+  EnvReader::finalize_pairs(&env_pairs, nullptr, &environment);
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "env file default ${NOWHERE}");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, InterpolationDashedKeys) {
+  // A defined key with a dash wins over reading the dash as a default.
+  string input("my=short\n"
+      "my-key=secret\n"
+      "c=\"${my-key}\"\n"
+      "d=\"${nope-other} ${my-other}\"\n"
+      "e=\"${a.b-c}\"\n"
+      "f=\"${late-key} ${missing:-x}\"\n"
+      "late-key=late\n"
+      "a.b-c=dotted\n");
+  const std::vector<string> expected{
+      "short", "secret", "secret", "other short", "dotted", "late x", "late",
+      "dotted"};
+
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  for (const EnvPair* pair : env_pairs) {
+    EnvReader::finalize_value(pair, &env_pairs);
+  }
+  std::vector<string> values;
+  for (const EnvPair* pair : env_pairs) {
+    values.push_back(*pair->value->value);
+  }
+  EXPECT_EQ(values, expected);
+  EnvReader::delete_pairs(&env_pairs);
+  env_pairs.clear();
+
+  EnvStream pairs_stream(&input);
+  EnvReader::read_pairs(&pairs_stream, &env_pairs);
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  values.clear();
+  for (const EnvPair* pair : env_pairs) {
+    values.push_back(*pair->value->value);
+  }
+  EXPECT_EQ(values, expected);
+  EnvReader::delete_pairs(&env_pairs);
+  env_pairs.clear();
+
+  EnvStream resolver_stream(&input);
+  cppnv::EnvPairResolver resolver(&resolver_stream);
+  std::map<string, string> resolved;
+  while (EnvPair* pair = resolver.next()) {
+    resolved.emplace(*pair->key->key, *pair->value->value);
+    EnvReader::delete_pair(pair);
+  }
+  EXPECT_EQ(resolved["c"], "secret");
+  EXPECT_EQ(resolved["d"], "other short");
+  EXPECT_EQ(resolved["f"], "late x");
+
+  // Dashed environment variables count as defined too.
+  const char* envp[] = {"FROM-ENV=env", nullptr};
+  const cppnv::EnvironmentSnapshot environment(envp);
+  string from_env("FROM=file\na=\"${FROM-ENV}\"\n");
+  EnvStream env_stream2(&from_env);
+  EnvReader::read_pairs(&env_stream2, &env_pairs);
+  EnvReader::finalize_pairs(&env_pairs, nullptr, &environment);
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "env");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, ReadPairTable) {
+  string basic("a=bc\n"
+      "# comment\n"
+      "b='single ${a}'\n"
+      "c=\"\"\"x ${ a } ${b}\"\"\"\n"
+      "d=e\r\n");
+  EnvStream basic_stream(&basic);
+
+  cppnv::EnvPairTable table;
+  EXPECT_EQ(EnvReader::read_pairs(&basic_stream, &table), 4);
+
+  ASSERT_EQ(table.size(), 4);
+  EXPECT_EQ(table.key(0), "a");
+  EXPECT_EQ(table.value(0), "bc");
+  EXPECT_TRUE(table.has_flag(0, cppnv::EnvPairTable::implicit_double_quote));
+  EXPECT_EQ(table.key(1), "b");
+  EXPECT_EQ(table.value(1), "single ${a}");
+  EXPECT_TRUE(table.has_flag(1, cppnv::EnvPairTable::quoted));
+  EXPECT_EQ(table.interpolation_count(1), 0);
+  EXPECT_EQ(table.key(2), "c");
+  EXPECT_EQ(table.value(2), "x ${ a } ${b}");
+  EXPECT_TRUE(table.has_flag(2, cppnv::EnvPairTable::triple_double_quoted));
+  ASSERT_EQ(table.interpolation_count(2), 2);
+  const size_t first = table.interpolation_offsets[2];
+  EXPECT_EQ(table.dollar_signs[first], 2);
+  EXPECT_EQ(table.end_braces[first], 7);
+  EXPECT_EQ(table.value(2).substr(table.variable_starts[first],
+                                  table.variable_lengths[first]), "a");
+  EXPECT_EQ(table.value(2).substr(table.variable_starts[first + 1],
+                                  table.variable_lengths[first + 1]), "b");
+  EXPECT_EQ(table.key(3), "d");
+  EXPECT_EQ(table.value(3), "e");
+}
+
+TEST_F(DotEnvTest, PairReader) {
+  string basic("a=1\n"
+      "# comment\n"
+      "b=${c}\n"
+      "c=2\n"
+      "d=");
+  EnvStream basic_stream(&basic);
+
+  cppnv::EnvPairReader reader(&basic_stream);
+  std::vector<EnvPair*> env_pairs;
+  while (EnvPair* pair = reader.next()) {
+    env_pairs.push_back(pair);
+  }
+  EXPECT_EQ(reader.next(), nullptr);
+
+  ASSERT_EQ(env_pairs.size(), 4);
+  EXPECT_EQ(*env_pairs.at(0)->key->key, "a");
+  EXPECT_TRUE(env_pairs.at(0)->value->is_already_interpolated);
+  EXPECT_EQ(*env_pairs.at(1)->key->key, "b");
+  EXPECT_FALSE(env_pairs.at(1)->value->is_already_interpolated);
+  EXPECT_EQ(*env_pairs.at(3)->key->key, "d");
+  EXPECT_EQ(*env_pairs.at(3)->value->value, "");
+  EnvReader::finalize_value(env_pairs.at(1), &env_pairs);
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "2");
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, PairReaderStopsEarly) {
+  string basic("a=1\n"
+      "b=\"\"\"never\n"
+      "closed\n");
+  EnvStream basic_stream(&basic);
+
+  cppnv::EnvPairReader reader(&basic_stream);
+  EnvPair* pair = reader.next();
+  ASSERT_NE(pair, nullptr);
+  EXPECT_EQ(*pair->key->key, "a");
+  EXPECT_EQ(*pair->value->value, "1");
+  EXPECT_TRUE(basic_stream.good());
+  EnvReader::delete_pair(pair);
+}
+
+TEST_F(DotEnvTest, PairResolverEmitsResolvedPairsFirst) {
+  string input("late=\"${early} then ${later}\"\n"
+      "early=one\n"
+      "copy=\"${early}!\"\n"
+      "later=\"${early} two\"\n"
+      "loop=\"${loop}\"\n"
+      "unknown=\"${missing}\"\n");
+  EnvStream env_stream(&input);
+  cppnv::EnvPairResolver resolver(&env_stream);
+  std::vector<std::pair<string, string>> emitted;
+  while (EnvPair* pair = resolver.next()) {
+    emitted.emplace_back(*pair->key->key, *pair->value->value);
+    EnvReader::delete_pair(pair);
+  }
+  const std::vector<std::pair<string, string>> expected{
+      {"early", "one"},
+      {"copy", "one!"},
+      {"later", "one two"},
+      {"late", "one then one two"},
+      {"loop", "${loop}"},
+      {"unknown", "${missing}"}};
+  EXPECT_EQ(emitted, expected);
+}
+
+
+namespace {
+// Finalizes input with finalize_pairs and with EnvPairResolver, for tests
+// that both agree. The resolver emits in a different order, so both come
+// back sorted.
+void ResolveBothWays(string input,
+                     std::vector<std::pair<string, string>>* expected,
+                     std::vector<std::pair<string, string>>* emitted) {
+  std::vector<EnvPair*> env_pairs;
+  EnvStream pairs_stream(&input);
+  EnvReader::read_pairs(&pairs_stream, &env_pairs);
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  for (const EnvPair* pair : env_pairs) {
+    expected->emplace_back(*pair->key->key, *pair->value->value);
+  }
+  EnvReader::delete_pairs(&env_pairs);
+
+  EnvStream resolver_stream(&input);
+  cppnv::EnvPairResolver resolver(&resolver_stream);
+  while (EnvPair* pair = resolver.next()) {
+    emitted->emplace_back(*pair->key->key, *pair->value->value);
+    EnvReader::delete_pair(pair);
+  }
+  std::sort(expected->begin(), expected->end());
+  std::sort(emitted->begin(), emitted->end());
+}
+}  // namespace
+
+TEST_F(DotEnvTest, PairResolverWaitsOnDashedReferences) {
+  // Where a dashed name ends depends on keys further down the stream, so the
+  // resolver has to agree with finalize_pairs over the whole input.
+  const std::vector<string> inputs{
+      "B=v6\nB=v3${B-x}\nB-x=\n",
+      "A=\nD=${A-B}\nA-B=v8\n",
+      "A=1\nC=${A:-x} ${A-y}\nA-y=2\n",
+      "E=${F-G}\nF=f\n"};
+  for (const string& input : inputs) {
+    std::vector<std::pair<string, string>> expected;
+    std::vector<std::pair<string, string>> emitted;
+    ResolveBothWays(input, &expected, &emitted);
+    EXPECT_EQ(emitted, expected) << input;
+  }
+}
+
+TEST_F(DotEnvTest, PairResolverDropsUnreferencedValues) {
+  // Values are dropped once nothing further down or still waiting can
+  // reference them; redefinitions after that must not take their place.
+  const std::vector<string> inputs{
+      "A=1\nB=${A}\nA=2\nC=${A}\n",
+      "A=1\nB=${A}\nA=2\nC=\"${B} ${A}\"\n",
+      "W=\"${LATE} ${A}\"\nA=1\nB=${A}\nA=2\nLATE=${A}\n",
+      "A=1\nW=\"${LATE-x} ${A}\"\nA=2\nLATE-x=3\n",
+      "A=1\n# ${A}\nB='${A}'\nA=2\nC=\"${A}\"\n",
+      "A=1\nB=\"${A\\tB}\"\nA=2\nC=${A}\n"};
+  for (const string& input : inputs) {
+    std::vector<std::pair<string, string>> expected;
+    std::vector<std::pair<string, string>> emitted;
+    ResolveBothWays(input, &expected, &emitted);
+    EXPECT_EQ(emitted, expected) << input;
+  }
+
+  string long_input("BASE=base\n");
+  for (int i = 0; i < 1000; i++) {
+    const string index = std::to_string(i);
+    long_input += "P" + index + "=plain " + index + "\nK" + index +
+                  "=\"${P" + index + "} ${BASE}\"\n";
+  }
+  long_input += "LAST=\"${K999} ${P0}\"\n";
+  std::vector<std::pair<string, string>> expected;
+  std::vector<std::pair<string, string>> emitted;
+  ResolveBothWays(long_input, &expected, &emitted);
+  EXPECT_EQ(emitted, expected);
+}
+
+TEST_F(DotEnvTest, ReaderContextReusesPairs) {
+  string first("a=bc\n"
+      "b=\"${a} quoted\"\n");
+  string second("# different document\n"
+      "c=\\tcd\n");
+
+  cppnv::EnvReaderContext context;
+  EnvStream first_stream(&first);
+  const std::vector<EnvPair*>& env_pairs = context.read_pairs(&first_stream);
+  ASSERT_EQ(env_pairs.size(), 2);
+  EXPECT_EQ(*env_pairs.at(0)->key->key, "a");
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "bc");
+  EXPECT_EQ(*env_pairs.at(1)->key->key, "b");
+  EXPECT_EQ(*env_pairs.at(1)->value->value, "${a} quoted");
+  EXPECT_EQ(env_pairs.at(1)->value->interpolations.size(), 1);
+  const EnvPair* first_pair = env_pairs.at(0);
+
+  EnvStream second_stream(&second);
+  context.read_pairs(&second_stream);
+  ASSERT_EQ(env_pairs.size(), 1);
+  EXPECT_EQ(env_pairs.at(0), first_pair);
+  EXPECT_EQ(*env_pairs.at(0)->key->key, "c");
+  EXPECT_EQ(*env_pairs.at(0)->value->value, "\tcd");
+  EXPECT_TRUE(env_pairs.at(0)->value->interpolations.empty());
+  EXPECT_TRUE(env_pairs.at(0)->value->implicit_double_quote);
+}
+
+TEST_F(DotEnvTest, DocumentEdits) {
+  string text;
+  for (int i = 0; i < 100; i++) {
+    text += "K_" + std::to_string(i) + "=value_" + std::to_string(i) + "\n";
+  }
+  cppnv::EnvDocument document(text);
+  // The spans must match a full parse of the edited text.
+  const auto matches_full_parse = [](const cppnv::EnvDocument& edited) {
+    string copy = edited.text();
+    EnvStream env_stream(&copy);
+    std::vector<EnvPair*> env_pairs;
+    EnvReader::read_pairs(&env_stream, &env_pairs);
+    size_t next = 0;
+    size_t end = 0;
+    bool same = true;
+    for (const auto& span : edited.spans()) {
+      same = same && span.start == end;
+      end = span.end;
+      if (span.pair == nullptr) {
+        continue;
+      }
+      same = same && next < env_pairs.size() &&
+             *span.pair->key->key == *env_pairs[next]->key->key &&
+             *span.pair->value->value == *env_pairs[next]->value->value;
+      next++;
+    }
+    same = same && next == env_pairs.size() && end == copy.size();
+    EnvReader::delete_pairs(&env_pairs);
+    return same;
+  };
+  ASSERT_TRUE(matches_full_parse(document));
+
+  size_t first;
+  size_t count;
+  const size_t value_50 = text.find("value_50");
+  ASSERT_TRUE(document.edit(value_50, 5, "VALUE", &first, &count));
+  EXPECT_LE(count, 2u);
+  EXPECT_TRUE(matches_full_parse(document));
+  EXPECT_EQ(*document.spans()[first + count - 1].pair->value->value,
+            "VALUE_50");
+
+  // An opened heredoc takes in the lines up to where it is closed, and the
+  // reparse stops there.
+  const size_t line_30 = document.text().find("K_30=");
+  ASSERT_TRUE(document.edit(line_30, 0, "\"\"\"\n", &first, &count));
+  EXPECT_TRUE(matches_full_parse(document));
+  const size_t value_20 = document.text().find("value_20");
+  ASSERT_TRUE(document.edit(value_20, 0, "\"\"\"\n", &first, &count));
+  EXPECT_LE(count, 2u);
+  EXPECT_TRUE(matches_full_parse(document));
+  EXPECT_EQ(document.spans().size(), 100u - 9u);
+  ASSERT_TRUE(document.edit(value_20, 4, "", &first, &count));
+  EXPECT_TRUE(matches_full_parse(document));
+
+  EXPECT_FALSE(document.edit(document.text().size() + 1, 0, "x"));
+  ASSERT_TRUE(document.edit(0, document.text().size(), ""));
+  EXPECT_TRUE(document.spans().empty());
+}
+
+TEST_F(DotEnvTest, WriterRoundTrip) {
+  string input("bare=plain value\n"
+      "spaced=' padded '\n"
+      "hash=\"a # b\"\n"
+      "multi=\"line\\none\\ttab\"\n"
+      "quotes='''it's \"both\"'''\n"
+      "literal='${not_a_var}'\n"
+      "live=\"${bare} again\"\n");
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), 7);
+
+  size_t size;
+  ASSERT_EQ(cppnv::EnvWriter::serialized_size(&env_pairs, &size),
+            cppnv::EnvWriter::success);
+  string output(size, '\0');
+  size_t written;
+  ASSERT_EQ(cppnv::EnvWriter::write_pairs(&env_pairs, output.data(),
+                                          size - 1, &written),
+            cppnv::EnvWriter::buffer_too_small);
+  EXPECT_EQ(written, size);
+  ASSERT_EQ(cppnv::EnvWriter::write_pairs(&env_pairs, output.data(),
+                                          output.size(), &written),
+            cppnv::EnvWriter::success);
+  EXPECT_EQ(written, size);
+  EXPECT_EQ(output, "bare=plain value\n"
+      "spaced=' padded '\n"
+      "hash='a # b'\n"
+      "multi=\"line\\none\\ttab\"\n"
+      "quotes=it's \"both\"\n"
+      "literal='${not_a_var}'\n"
+      "live=${bare} again\n");
+
+  std::vector<EnvPair*> round_trip;
+  EnvStream output_stream(&output);
+  EnvReader::read_pairs(&output_stream, &round_trip);
+  ASSERT_EQ(round_trip.size(), env_pairs.size());
+  for (EnvPair* pair : env_pairs) {
+    EnvReader::finalize_value(pair, &env_pairs);
+  }
+  for (EnvPair* pair : round_trip) {
+    EnvReader::finalize_value(pair, &round_trip);
+  }
+  for (size_t i = 0; i < env_pairs.size(); i++) {
+    EXPECT_EQ(*round_trip.at(i)->key->key, *env_pairs.at(i)->key->key);
+    EXPECT_EQ(*round_trip.at(i)->value->value,
+              *env_pairs.at(i)->value->value);
+  }
+  EXPECT_EQ(*round_trip.at(6)->value->value, "plain value again");
+  EnvReader::delete_pairs(&env_pairs);
+  EnvReader::delete_pairs(&round_trip);
+}
+
+TEST_F(DotEnvTest, WriterRejectsUnreadableKeys) {
+  string input("a=b\n");
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&input);
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  ASSERT_EQ(env_pairs.size(), 1);
+  size_t size;
+  *env_pairs.at(0)->key->key = "a=b";
+  EXPECT_EQ(cppnv::EnvWriter::serialized_size(&env_pairs, &size),
+            cppnv::EnvWriter::invalid_key);
+  *env_pairs.at(0)->key->key = " a";
+  EXPECT_EQ(cppnv::EnvWriter::serialized_size(&env_pairs, &size),
+            cppnv::EnvWriter::invalid_key);
+  *env_pairs.at(0)->key->key = "a";
+  *env_pairs.at(0)->value->value = "caf\xc3\xa9";
+  EXPECT_EQ(cppnv::EnvWriter::serialized_size(&env_pairs, &size),
+            cppnv::EnvWriter::invalid_value);
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, ValueSink) {
+  class CollectingSink : public cppnv::EnvValueSink {
+   public:
+    size_t threshold() const override { return 1000; }
+    void begin(const string& key) override { values.emplace_back(key, ""); }
+    void write(const char* data, const size_t length) override {
+      values.back().second.append(data, length);
+      writes++;
+    }
+    void end() override { ends++; }
+
+    std::vector<std::pair<string, string>> values;
+    size_t writes = 0;
+    size_t ends = 0;
+  };
+
+  string text = "SMALL=short\nCERT=\"\"\"\n";
+  for (int i = 0; i < 200; i++) {
+    text += "line " + std::to_string(i) + " \\\"quoted\\\" \\t tab\r\n";
+  }
+  text += "\"\"\"\nLONG=" + string(3000, 'x') + string(100, ' ') +
+          "# comment\nSIMPLE=" + string(3000, 'y') + "\nLITERAL=\"${SMALL}" +
+          string(3000, 'z') + "\"\nMEDIUM='" + string(1100, 'm') +
+          "'\nREF=\"${SMALL}${CERT}\"\n";
+  string copy = text;
+
+  std::vector<EnvPair*> expected;
+  EnvStream expected_stream(&copy);
+  EnvReader::read_pairs(&expected_stream, &expected);
+  CollectingSink sink;
+  std::vector<EnvPair*> env_pairs;
+  EnvStream env_stream(&text);
+  EnvReader::read_pairs(&env_stream, &env_pairs, &sink);
+  ASSERT_EQ(env_pairs.size(), expected.size());
+
+  ASSERT_EQ(sink.values.size(), 5u);
+  EXPECT_EQ(sink.ends, 5u);
+  // The big values arrive in several chunks.
+  EXPECT_GT(sink.writes, sink.values.size());
+  size_t sunk = 0;
+  for (size_t i = 0; i < env_pairs.size(); i++) {
+    if (sunk < sink.values.size() &&
+        sink.values[sunk].first == *env_pairs[i]->key->key) {
+      EXPECT_EQ(sink.values[sunk].second, *expected[i]->value->value);
+      EXPECT_EQ(*env_pairs[i]->value->value, "");
+      sunk++;
+    } else {
+      EXPECT_EQ(*env_pairs[i]->value->value, *expected[i]->value->value);
+    }
+  }
+  EXPECT_EQ(sunk, 5u);
+  EXPECT_EQ(sink.values[1].first, "LONG");
+  EXPECT_EQ(sink.values[1].second, string(3000, 'x'));
+  EXPECT_EQ(sink.values[3].second.substr(0, 9), "${SMALL}z");
+
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  EXPECT_EQ(*env_pairs.back()->value->value, "short");
+  EnvReader::delete_pairs(&expected);
+  EnvReader::delete_pairs(&env_pairs);
+}
+
+TEST_F(DotEnvTest, ReaderContextSteadyStateDoesNotAllocate) {
+  string input("simple=value\n"
+      "# a comment\n"
+      "quoted='single ${quoted}'\n"
+      "escaped=\"tab\\there\"\n"
+      "heredoc=\"\"\"\nline one\nline two\n\"\"\"\n"
+      "four=\"${a}${b} ${c} ${d}\"\n");
+  cppnv::EnvReaderContext context;
+  for (int i = 0; i < 2; i++) {
+    EnvStream env_stream(&input);
+    context.read_pairs(&env_stream);
+  }
+
+  EnvStream env_stream(&input);
+  const AllocationCounter counter;
+  const std::vector<EnvPair*>& env_pairs = context.read_pairs(&env_stream);
+  EXPECT_EQ(counter.count(), 0);
+  ASSERT_EQ(env_pairs.size(), 5);
+  EXPECT_EQ(env_pairs.at(4)->value->interpolations.size(), 4);
+  EXPECT_TRUE(env_pairs.at(4)->value->interpolations.is_inline());
+}
+
+TEST_F(DotEnvTest, AllocationReport) {
+  // Budgets sit a little above what each phase allocates today, so growth
+  // in read_pair or finalize_value fails here instead of going unnoticed.
+  struct Corpus {
+    const char* name;
+    string text;
+    double read_allocs_per_pair;
+    double read_bytes_per_pair;
+    double finalize_allocs_per_pair;
+    double finalize_allocs_per_interpolation;
+  };
+  std::vector<Corpus> corpora{
+      {"simple", "a=1\nb=two\nc=three three\n", 8, 640, 4, 0},
+      {"quoted", "a='1'\nb=\"two\\n\"\nc=`three`\n", 9, 720, 4, 0},
+      {"heredoc",
+       "a=\"\"\"\none\ntwo\n\"\"\"\nb='''\nthree\n'''\n",
+       9,
+       720,
+       6,
+       0},
+      {"interpolated",
+       "a=1\nb=\"${a}/${a}\"\nc=\"${b}:${a}\"\n",
+       8,
+       640,
+       5,
+       4}};
+  for (Corpus& corpus : corpora) {
+    SCOPED_TRACE(corpus.name);
+    std::vector<EnvPair*> env_pairs;
+    EnvStream env_stream(&corpus.text);
+    const AllocationCounter read_counter;
+    EnvReader::read_pairs(&env_stream, &env_pairs);
+    const size_t read_count = read_counter.count();
+    const size_t read_bytes = read_counter.bytes();
+
+    size_t interpolations = 0;
+    for (const EnvPair* pair : env_pairs) {
+      interpolations += pair->value->interpolations.size();
+    }
+    const AllocationCounter finalize_counter;
+    EnvReader::finalize_pairs(&env_pairs, nullptr);
+    const size_t finalize_count = finalize_counter.count();
+
+    ASSERT_FALSE(env_pairs.empty());
+    const double pairs = static_cast<double>(env_pairs.size());
+    EXPECT_LE(read_count / pairs, corpus.read_allocs_per_pair);
+    EXPECT_LE(read_bytes / pairs, corpus.read_bytes_per_pair);
+    EXPECT_LE(finalize_count / pairs, corpus.finalize_allocs_per_pair);
+    if (interpolations > 0) {
+      EXPECT_LE(static_cast<double>(finalize_count) / interpolations,
+                corpus.finalize_allocs_per_interpolation);
+    }
+    EnvReader::delete_pairs(&env_pairs);
+  }
+}
+
+TEST_F(DotEnvTest, TypedValues) {
+  const string path = ::testing::TempDir() + "cppnv_typed.env";
+  std::ofstream(path) << "PORT=8080\nNEGATIVE=-12\nDEBUG=Yes\nQUIET=off\n"
+                         "TIMEOUT=1h30m\nPOLL=250ms\nCACHE=512MiB\nDISK=2G\n"
+                         "BAD=12abc\n";
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+
+  int64_t integer;
+  EXPECT_TRUE(dotenv.GetInt("PORT", &integer));
+  EXPECT_EQ(integer, 8080);
+  EXPECT_TRUE(dotenv.GetInt("NEGATIVE", &integer));
+  EXPECT_EQ(integer, -12);
+  EXPECT_FALSE(dotenv.GetInt("BAD", &integer));
+  EXPECT_FALSE(dotenv.GetInt("MISSING", &integer));
+  bool boolean;
+  EXPECT_TRUE(dotenv.GetBool("DEBUG", &boolean));
+  EXPECT_TRUE(boolean);
+  EXPECT_TRUE(dotenv.GetBool("QUIET", &boolean));
+  EXPECT_FALSE(boolean);
+  EXPECT_FALSE(dotenv.GetBool("PORT", &boolean));
+  std::chrono::nanoseconds duration;
+  EXPECT_TRUE(dotenv.GetDuration("TIMEOUT", &duration));
+  EXPECT_EQ(duration, std::chrono::minutes(90));
+  EXPECT_TRUE(dotenv.GetDuration("POLL", &duration));
+  EXPECT_EQ(duration, std::chrono::milliseconds(250));
+  EXPECT_FALSE(dotenv.GetDuration("PORT", &duration));
+  uint64_t bytes;
+  EXPECT_TRUE(dotenv.GetBytes("CACHE", &bytes));
+  EXPECT_EQ(bytes, 512u << 20);
+  EXPECT_TRUE(dotenv.GetBytes("DISK", &bytes));
+  EXPECT_EQ(bytes, 2000000000u);
+  EXPECT_TRUE(dotenv.GetBytes("PORT", &bytes));
+  EXPECT_EQ(bytes, 8080u);
+
+  // Reads after the first are served from the cache.
+  {
+    const AllocationCounter counter;
+    for (int i = 0; i < 100; i++) {
+      EXPECT_TRUE(dotenv.GetInt("PORT", &integer));
+      EXPECT_FALSE(dotenv.GetInt("MISSING", &integer));
+    }
+    EXPECT_EQ(counter.count(), 0u);
+  }
+
+  // Changing the store drops the cached conversions.
+  std::ofstream(path) << "PORT=9090\nMISSING=1\n";
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  EXPECT_TRUE(dotenv.GetInt("PORT", &integer));
+  EXPECT_EQ(integer, 9090);
+  EXPECT_TRUE(dotenv.GetInt("MISSING", &integer));
+  EXPECT_EQ(integer, 1);
+
+  // A kept key skips the lookup and follows the store when it changes.
+  node::Dotenv::TypedKey port("PORT");
+  node::Dotenv::TypedKey absent("ABSENT");
+  EXPECT_TRUE(dotenv.GetInt(&port, &integer));
+  EXPECT_EQ(integer, 9090);
+  {
+    const AllocationCounter counter;
+    for (int i = 0; i < 100; i++) {
+      EXPECT_TRUE(dotenv.GetInt(&port, &integer));
+      EXPECT_FALSE(dotenv.GetInt(&absent, &integer));
+    }
+    EXPECT_EQ(counter.count(), 0u);
+  }
+  std::ofstream(path) << "PORT=7070\n";
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  EXPECT_TRUE(dotenv.GetInt(&port, &integer));
+  EXPECT_EQ(integer, 7070);
+  node::Dotenv moved(std::move(dotenv));
+  EXPECT_TRUE(moved.GetBytes(&port, &bytes));
+  EXPECT_EQ(bytes, 7070u);
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, Profiles) {
+  string text =
+      "HOST=localhost\nURL=\"http://${HOST}:${PORT}\"\nPORT=80\n"
+      "[production]\nHOST=example.com\nREPLICAS=3\n"
+      "  [staging]  \nHOST=staging.example.com\nBROKEN=\"unclosed\n"
+      "[production]\nLOG=\"${HOST}.log\"\n";
+  const cppnv::EnvSectionIndex index(text);
+  EXPECT_EQ(index.preamble_end(), text.find("[production]"));
+  ASSERT_NE(index.find("production"), nullptr);
+  EXPECT_EQ(index.find("production")->size(), 2u);
+  EXPECT_EQ(index.find("dev"), nullptr);
+
+  std::vector<EnvPair*> env_pairs;
+  EXPECT_FALSE(EnvReader::read_profile(&text, index, "dev", &env_pairs));
+  EXPECT_TRUE(env_pairs.empty());
+  ASSERT_TRUE(
+      EnvReader::read_profile(&text, index, "production", &env_pairs));
+  EnvReader::finalize_pairs(&env_pairs, nullptr);
+  std::vector<std::pair<string, string>> values;
+  for (const EnvPair* pair : env_pairs) {
+    values.emplace_back(*pair->key->key, *pair->value->value);
+  }
+  // The profile's HOST replaces the shared one, shared URL included.
+  const std::vector<std::pair<string, string>> expected{
+      {"URL", "http://example.com:80"},
+      {"PORT", "80"},
+      {"HOST", "example.com"},
+      {"REPLICAS", "3"},
+      {"LOG", "example.com.log"}};
+  EXPECT_EQ(values, expected);
+  EnvReader::delete_pairs(&env_pairs);
+
+  const string path = ::testing::TempDir() + "cppnv_profiles.env";
+  std::ofstream(path) << text;
+  node::Dotenv dotenv;
+  EXPECT_FALSE(dotenv.ParseProfile(path, "dev"));
+  ASSERT_TRUE(dotenv.ParseProfile(path, "staging"));
+  int64_t port;
+  EXPECT_TRUE(dotenv.GetInt("PORT", &port));
+  EXPECT_EQ(port, 80);
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, PrefixIndex) {
+  string text =
+      "DB_PRIMARY_HOST=a\nDB_PRIMARY_PORT=1\nDB_REPLICA_HOST=b\n"
+      "DB=all\nDBX=x\nCACHE_TTL=60\nDB_PRIMARY_HOST=c\n";
+  EnvStream env_stream(&text);
+  std::vector<EnvPair*> env_pairs;
+  EnvReader::read_pairs(&env_stream, &env_pairs);
+  {
+    // Repeated keys stay in parse order.
+    const cppnv::EnvPrefixIndex index(env_pairs);
+    EXPECT_EQ(index.all().size(), env_pairs.size());
+    const auto primary = index.find("DB_PRIMARY_HOST");
+    ASSERT_EQ(primary.size(), 2u);
+    EXPECT_EQ(primary[0].second, "a");
+    EXPECT_EQ(primary[1].second, "c");
+  }
+  EnvReader::delete_pairs(&env_pairs);
+
+  const string path = ::testing::TempDir() + "cppnv_prefix.env";
+  std::ofstream(path) << text;
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  const cppnv::EnvPrefixIndex& index = dotenv.GetPrefixIndex();
+  EXPECT_EQ(index.all().size(), 6u);
+  EXPECT_EQ(index.find("DB").size(), 5u);
+
+  const auto db = index.strip("DB_");
+  ASSERT_EQ(db.size(), 3u);
+  EXPECT_EQ(db[0].first, "PRIMARY_HOST");
+  EXPECT_EQ(db[0].second, "c");
+  EXPECT_EQ(db[1].first, "PRIMARY_PORT");
+  EXPECT_EQ(db[2].first, "REPLICA_HOST");
+  const auto primary = db.strip("PRIMARY_");
+  ASSERT_EQ(primary.size(), 2u);
+  EXPECT_EQ(primary[0].first, "HOST");
+  EXPECT_EQ(primary[1].first, "PORT");
+  EXPECT_EQ(db.find("PRIMARY_P")[0].first, "PRIMARY_PORT");
+
+  EXPECT_TRUE(index.find("DB_PRIMARY_HOSTS").empty());
+  EXPECT_TRUE(index.find("DC").empty());
+  EXPECT_TRUE(db.find("STANDBY").empty());
+  EXPECT_EQ(index.find("").size(), 6u);
+
+  // Keys sort as unsigned bytes, so UTF-8 keys sit after the ASCII ones.
+  const std::map<string, string> utf8{{"DB_A", "1"},
+                                      {"DB_\xc3\xa9tat", "2"},
+                                      {"DB_Z", "3"},
+                                      {"DB_\xe2\x82\xac", "4"}};
+  const cppnv::EnvPrefixIndex utf8_index(utf8);
+  EXPECT_EQ(utf8_index.find("DB_\xc3").size(), 1u);
+  EXPECT_EQ(utf8_index.find("DB_\xc3\xa9tat")[0].second, "2");
+  EXPECT_EQ(utf8_index.strip("DB_\xe2")[0].first, "\x82\xac");
+  EXPECT_EQ(utf8_index.find("DB_Z")[0].second, "3");
+  EXPECT_TRUE(utf8_index.find("DB_\xc4").empty());
+
+  // Queries walk the trie without allocating.
+  {
+    const AllocationCounter counter;
+    for (int i = 0; i < 100; i++) {
+      EXPECT_EQ(dotenv.GetPrefixIndex().strip("DB_").find("R").size(), 1u);
+    }
+    EXPECT_EQ(counter.count(), 0u);
+  }
+
+  // Changing the store rebuilds the index.
+  std::ofstream(path) << "DB_STANDBY_HOST=d\n";
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  EXPECT_EQ(dotenv.GetPrefixIndex().strip("DB_").size(), 4u);
+  node::Dotenv copy = dotenv;
+  EXPECT_EQ(copy.GetPrefixIndex().find("DB_STANDBY").size(), 1u);
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, TraceEvents) {
+  const string path = ::testing::TempDir() + "cppnv_trace.env";
+  const string trace = ::testing::TempDir() + "cppnv_trace.json";
+  std::ofstream(path) << "A=1\nB=\"${A}\"\n";
+
+#ifndef _WIN32
+  const string directory =
+      ::testing::TempDir() + "cppnv_trace.d." + std::to_string(getpid());
+  ASSERT_EQ(mkdir(directory.c_str(), 0700), 0);
+  std::ofstream(directory + "/a.env") << "C=3\n";
+  std::ofstream(directory + "/b.env") << "D=4\n";
+#endif
+
+  cppnv::TraceEventWriter::Start();
+  EXPECT_TRUE(cppnv::TraceEventWriter::IsRecording());
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+#ifndef _WIN32
+  ASSERT_TRUE(dotenv.ParseDirectory(directory, ".env", 2));
+#endif
+  ASSERT_TRUE(cppnv::TraceEventWriter::Stop(trace));
+  EXPECT_FALSE(cppnv::TraceEventWriter::IsRecording());
+
+  std::ifstream input(trace);
+  std::stringstream json;
+  json << input.rdbuf();
+  EXPECT_EQ(json.str().rfind("{\"traceEvents\":[", 0), 0);
+  EXPECT_NE(json.str().find("\"name\":\"ParsePath\""), string::npos);
+  EXPECT_NE(json.str().find("\"name\":\"read_pairs\""), string::npos);
+  EXPECT_NE(json.str().find("\"args\":{\"pairs\":2}"), string::npos);
+  EXPECT_NE(json.str().find("\"name\":\"finalize_pairs\""), string::npos);
+#ifndef _WIN32
+  EXPECT_NE(json.str().find("\"pid\":" + std::to_string(getpid()) + ","),
+            string::npos);
+  // Every fragment gets its own span, on whichever worker parsed it.
+  const size_t file = json.str().find("\"name\":\"ParseFile\"");
+  ASSERT_NE(file, string::npos);
+  EXPECT_NE(json.str().find("\"name\":\"ParseFile\"", file + 1),
+            string::npos);
+  EXPECT_NE(json.str().find("\"name\":\"ParseDirectory\""), string::npos);
+  std::remove((directory + "/a.env").c_str());
+  std::remove((directory + "/b.env").c_str());
+  rmdir(directory.c_str());
+#endif
+  std::remove(path.c_str());
+  std::remove(trace.c_str());
+}
+
+#ifndef _WIN32
+TEST_F(DotEnvTest, SetProcessEnvironment) {
+  const string path = ::testing::TempDir() + "cppnv_set_process_env.env";
+  std::ofstream(path) << "CPPNV_EXPORT_NEW=fresh\n"
+      "CPPNV_EXPORT_OLD=replaced\n";
+  setenv("CPPNV_EXPORT_OLD", "kept", 1);
+
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+
+  ASSERT_TRUE(dotenv.SetProcessEnvironment(false));
+  EXPECT_STREQ(getenv("CPPNV_EXPORT_NEW"), "fresh");
+  EXPECT_STREQ(getenv("CPPNV_EXPORT_OLD"), "kept");
+
+  ASSERT_TRUE(dotenv.SetProcessEnvironment(true));
+  EXPECT_STREQ(getenv("CPPNV_EXPORT_NEW"), "fresh");
+  EXPECT_STREQ(getenv("CPPNV_EXPORT_OLD"), "replaced");
+
+  unsetenv("CPPNV_EXPORT_NEW");
+  unsetenv("CPPNV_EXPORT_OLD");
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, GetEnvp) {
+  const string path = ::testing::TempDir() + "cppnv_get_envp.env";
+  std::ofstream(path) << "B=from_file\nC=3\n";
+  char a[] = "A=1";
+  char b[] = "B=2";
+  char* base[] = {a, b, nullptr};
+
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+
+  char* const* envp = dotenv.GetEnvp(base);
+  ASSERT_NE(envp, nullptr);
+  EXPECT_STREQ(envp[0], "A=1");
+  EXPECT_STREQ(envp[1], "B=from_file");
+  EXPECT_STREQ(envp[2], "C=3");
+  EXPECT_EQ(envp[3], nullptr);
+  EXPECT_EQ(dotenv.GetEnvp(base), envp);
+  {
+    const AllocationCounter counter;
+    EXPECT_EQ(dotenv.GetEnvp(base), envp);
+    EXPECT_EQ(counter.count(), 0);
+  }
+
+  // Changing an entry of base, the way setenv() changes environ, rebuilds.
+  char e[] = "E=5";
+  base[0] = e;
+  envp = dotenv.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "E=5");
+  EXPECT_STREQ(envp[1], "B=from_file");
+  base[0] = a;
+  envp = dotenv.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=1");
+
+  std::ofstream(path) << "D=4\n";
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  envp = dotenv.GetEnvp(base);
+  EXPECT_STREQ(envp[3], "D=4");
+  EXPECT_EQ(envp[4], nullptr);
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, ParseCache) {
+  const string path = ::testing::TempDir() + "cppnv_parse_cache.env";
+  const string copy = ::testing::TempDir() + "cppnv_parse_cache_copy.env";
+  std::ofstream(path) << "A=1\nB=\"${A}2\"\n";
+  node::Dotenv::SetParseCacheEnabled(true);
+
+  node::Dotenv first;
+  ASSERT_TRUE(first.ParsePath(path));
+  node::Dotenv second;
+  ASSERT_TRUE(second.ParsePath(path));
+  EXPECT_FALSE(second.ParsePath(path + ".missing"));
+
+  // A changed file is parsed again, a copy of a parsed one is not.
+  std::ofstream(path) << "A=33\nB=\"${A}4\"\n";
+  std::ofstream(copy) << "A=33\nB=\"${A}4\"\n";
+  node::Dotenv changed;
+  ASSERT_TRUE(changed.ParsePath(path));
+  node::Dotenv copied;
+  ASSERT_TRUE(copied.ParsePath(copy));
+  // Same size, different bytes: only equal content shares entries.
+  std::ofstream(copy) << "A=35\nB=\"${A}6\"\n";
+  node::Dotenv same_size;
+  ASSERT_TRUE(same_size.ParsePath(copy));
+  node::Dotenv::SetParseCacheEnabled(false);
+
+  char* base[] = {nullptr};
+  char* const* envp = first.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=1");
+  EXPECT_STREQ(envp[1], "B=12");
+  envp = second.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=1");
+  EXPECT_STREQ(envp[1], "B=12");
+  envp = changed.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=33");
+  EXPECT_STREQ(envp[1], "B=334");
+  envp = copied.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=33");
+  EXPECT_STREQ(envp[1], "B=334");
+  envp = same_size.GetEnvp(base);
+  EXPECT_STREQ(envp[0], "A=35");
+  EXPECT_STREQ(envp[1], "B=356");
+  std::remove(path.c_str());
+  std::remove(copy.c_str());
+}
+
+TEST_F(DotEnvTest, ParseDirectory) {
+  const string directory =
+      ::testing::TempDir() + "cppnv_env.d." + std::to_string(getpid());
+  ASSERT_EQ(mkdir(directory.c_str(), 0700), 0);
+  ASSERT_EQ(mkdir((directory + "/nested.env").c_str(), 0700), 0);
+  std::vector<string> files{"/.hidden.env", "/notes.txt"};
+  // Enough fragments that every worker gets some and steals from the others.
+  for (int i = 0; i < 64; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%02d-fragment.env", i);
+    files.push_back(name);
+    std::ofstream(directory + name)
+        << "LAST=" << i << "\nFRAGMENT_" << i << "=\"${LAST}\"\n";
+  }
+  std::ofstream(directory + "/.hidden.env") << "LAST=hidden\n";
+  std::ofstream(directory + "/notes.txt") << "LAST=notes\n";
+  // Only regular files are parsed, whatever a link points at.
+  ASSERT_EQ(symlink((directory + "/nested.env").c_str(),
+                    (directory + "/linked-dir.env").c_str()), 0);
+  ASSERT_EQ(symlink((directory + "/00-fragment.env").c_str(),
+                    (directory + "/linked-file.env").c_str()), 0);
+  ASSERT_EQ(mkfifo((directory + "/pipe.env").c_str(), 0600), 0);
+  files.insert(files.end(), {"/linked-dir.env", "/linked-file.env",
+                             "/pipe.env"});
+
+  node::Dotenv serial;
+  ASSERT_TRUE(serial.ParseDirectory(directory, ".env", 1));
+  node::Dotenv parallel;
+  ASSERT_TRUE(parallel.ParseDirectory(directory + "/", ".env", 4));
+  node::Dotenv missing;
+  EXPECT_FALSE(missing.ParseDirectory(directory + "/missing"));
+
+  char* base[] = {nullptr};
+  char* const* serial_envp = serial.GetEnvp(base);
+  char* const* parallel_envp = parallel.GetEnvp(base);
+  size_t count = 0;
+  for (; serial_envp[count] != nullptr; count++) {
+    EXPECT_STREQ(serial_envp[count], parallel_envp[count]);
+  }
+  EXPECT_EQ(parallel_envp[count], nullptr);
+  EXPECT_EQ(count, 65u);
+  EXPECT_STREQ(serial_envp[0], "FRAGMENT_0=0");
+  // linked-file.env sorts last and repeats 00-fragment.env.
+  EXPECT_STREQ(serial_envp[count - 1], "LAST=0");
+
+  for (const string& file : files) {
+    std::remove((directory + file).c_str());
+  }
+  rmdir((directory + "/nested.env").c_str());
+  rmdir(directory.c_str());
+}
+
+TEST_F(DotEnvTest, SharedEnvImage) {
+  const string path = ::testing::TempDir() + "cppnv_shared_image.env";
+  const string name = "/cppnv_test_" + std::to_string(getpid());
+  std::ofstream(path) << "A=1\nB=\"two ${A}\"\n";
+  node::Dotenv dotenv;
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  EXPECT_EQ(node::SharedEnvImage::Open(name), nullptr);
+  ASSERT_TRUE(dotenv.PublishSnapshot(name));
+
+  const auto image = node::SharedEnvImage::Open(name);
+  ASSERT_NE(image, nullptr);
+  EXPECT_EQ(image->Size(), 2);
+  EXPECT_EQ(image->Generation(), 1);
+  std::string_view value;
+  ASSERT_TRUE(image->Get("B", &value));
+  EXPECT_EQ(value, "two 1");
+  EXPECT_FALSE(image->Get("C", &value));
+  EXPECT_FALSE(image->IsStale());
+
+  // Only the owner can read the values.
+  const int segment = shm_open((name + ".1").c_str(), O_RDONLY, 0);
+  ASSERT_GE(segment, 0);
+  struct stat segment_stat;
+  ASSERT_EQ(fstat(segment, &segment_stat), 0);
+  EXPECT_EQ(segment_stat.st_mode & 0777, 0600u);
+  close(segment);
+
+  std::ofstream(path) << "C=3\n";
+  ASSERT_TRUE(dotenv.ParsePath(path));
+  ASSERT_TRUE(dotenv.PublishSnapshot(name));
+  EXPECT_TRUE(image->IsStale());
+  // The old generation stays mapped and readable.
+  ASSERT_TRUE(image->Get("A", &value));
+  EXPECT_EQ(value, "1");
+
+  const auto next = node::SharedEnvImage::Open(name);
+  ASSERT_NE(next, nullptr);
+  EXPECT_EQ(next->Generation(), 2);
+  ASSERT_TRUE(next->Get("C", &value));
+  EXPECT_EQ(value, "3");
+
+  // A segment named like the next generation, from a publisher that died or
+  // one still writing, is skipped and left alone.
+  const string taken = name + ".3";
+  const int stale = shm_open(taken.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  ASSERT_GE(stale, 0);
+  close(stale);
+  ASSERT_TRUE(dotenv.PublishSnapshot(name));
+  const auto skipped = node::SharedEnvImage::Open(name);
+  ASSERT_NE(skipped, nullptr);
+  EXPECT_EQ(skipped->Generation(), 4);
+  ASSERT_TRUE(skipped->Get("C", &value));
+  const int kept = shm_open(taken.c_str(), O_RDONLY, 0);
+  EXPECT_GE(kept, 0);
+  close(kept);
+  shm_unlink(taken.c_str());
+  node::SharedEnvImage::Unlink(name);
+  EXPECT_EQ(node::SharedEnvImage::Open(name), nullptr);
+  std::remove(path.c_str());
+}
+
+TEST_F(DotEnvTest, SharedEnvImageConcurrentPublishers) {
+  const string name = "/cppnv_publishers_" + std::to_string(getpid());
+  constexpr int kThreads = 4;
+  constexpr int kRounds = 50;
+  std::vector<std::thread> threads;
+  std::atomic<int> failures{0};
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&name, &failures, t]() {
+      for (int round = 0; round < kRounds; round++) {
+        const std::map<string, string> entries{
+            {"THREAD", std::to_string(t)}, {"ROUND", std::to_string(round)}};
+        if (!node::SharedEnvImage::Publish(name, entries)) {
+          failures++;
+        }
+        // Whatever is current is always a complete image.
+        if (const auto image = node::SharedEnvImage::Open(name)) {
+          std::string_view value;
+          if (image->Size() != 2 || !image->Get("ROUND", &value)) {
+            failures++;
+          }
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(failures.load(), 0);
+  const auto image = node::SharedEnvImage::Open(name);
+  ASSERT_NE(image, nullptr);
+  EXPECT_EQ(image->Generation(), uint64_t{kThreads * kRounds});
+  // Every generation but the current one was unlinked by whoever passed it.
+  for (uint64_t generation = 1; generation < image->Generation();
+       generation++) {
+    const string segment = name + "." + std::to_string(generation);
+    EXPECT_LT(shm_open(segment.c_str(), O_RDONLY, 0), 0) << segment;
+  }
+  node::SharedEnvImage::Unlink(name);
+}
+#endif